@@ -0,0 +1,379 @@
+/*
+ * Microbenchmark of the limiter engine, without httpd.
+ * Forks procs processes of threads threads each, which acquire and release
+ * a DirLimit/DirLimitPerSub chain over Zipf distributed subdirectories.
+ *
+ *   make bench BENCH_ARGS="-p 4 -t 8 -n 1000000 -k 1000 -s 0.99"
+ */
+#include "apr_general.h"
+#include "apr_getopt.h"
+#include "apr_shm.h"
+#include "apr_strings.h"
+#include "apr_thread_proc.h"
+#include "dirlimit_engine.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+/* latency histogram: 8 linear buckets per power of 2, in nsec */
+#define LAT_SUB 8
+#define LAT_BUCKETS (62 * LAT_SUB)
+
+typedef struct {
+    uint64_t ops;
+    uint64_t rejected;
+    uint64_t lockerror;
+    uint64_t nsec;
+    uint64_t lat_max;
+    dirlimit_lockstat lock;
+    uint64_t lat[LAT_BUCKETS];
+} bench_result;
+
+typedef struct {
+    int procs;
+    int threads;
+    long ops;
+    int keys;
+    double skew;
+    int limit;
+    int limit_sub;
+    int table_size;
+    int hold_usec;
+    int lease;
+} bench_opts;
+
+static bench_opts opts = { 2, 4, 200000, 1000, 0.99, -1, 4, 4096, 0, 0 };
+static dirlimit_engine engine;
+static dirlimit_chain chain;
+static dirlimit_key *keys;
+static double *cdf;
+static bench_result *results;
+
+static inline uint64_t now_nsec( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline int lat_bucket( uint64_t ns )
+{
+    int msb;
+    if( ns < LAT_SUB ) {
+        return (int)ns;
+    }
+    msb = 63 - __builtin_clzll(ns);
+    return (msb - 2) * LAT_SUB + (int)((ns >> (msb - 3)) & (LAT_SUB - 1));
+}
+
+/* upper bound of bucket b */
+static inline uint64_t lat_value( int b )
+{
+    int msb;
+    if( b < LAT_SUB ) {
+        return b;
+    }
+    msb = b / LAT_SUB + 2;
+    return ((uint64_t)(LAT_SUB + b % LAT_SUB + 1) << (msb - 3)) - 1;
+}
+
+static inline uint64_t xorshift( uint64_t *s )
+{
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 2685821657736338717ULL;
+}
+
+/* rank of a Zipf distributed key, 0 being the hottest */
+static int pick_key( uint64_t *seed )
+{
+    double u = (double)(xorshift(seed) >> 11) / (double)(1ULL << 53);
+    int lo = 0, hi = opts.keys - 1, mid;
+
+    while( lo < hi ) {
+        mid = (lo + hi) / 2;
+        if( cdf[mid] < u ) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void setup_keys( apr_pool_t *p )
+{
+    double sum = 0;
+    int i;
+
+    keys = apr_palloc( p, sizeof(dirlimit_key) * opts.keys );
+    cdf = apr_palloc( p, sizeof(double) * opts.keys );
+    for( i=0; i<opts.keys; i++ ) {
+        keys[i].conf_id = 0;
+        keys[i].dirname = apr_psprintf( p, "dir%d", i );
+        keys[i].dirname_len = strlen( keys[i].dirname );
+        keys[i].hash = dirlimit_hash_record( 0, keys[i].dirname, keys[i].dirname_len );
+        sum += 1.0 / pow( i + 1, opts.skew );
+        cdf[i] = sum;
+    }
+    for( i=0; i<opts.keys; i++ ) {
+        cdf[i] /= sum;
+    }
+}
+
+static void setup_chain( apr_pool_t *p )
+{
+    dirlimit_level *lv;
+
+    chain.levels = apr_pcalloc( p, sizeof(dirlimit_level) );
+    chain.levels_num = 1;
+    lv = &chain.levels[0];
+    lv->conf_id = 0;
+    lv->limit = opts.limit;
+    lv->limit_script = -1;
+    lv->limit_sub = opts.limit_sub;
+    lv->limit_sub_script = -1;
+    lv->limit_client = -1;
+    lv->limit_client_script = -1;
+    lv->lease = opts.lease;
+    lv->lease_min = opts.lease;
+    if( opts.limit >= 0 ) {
+        lv->flags |= LEVEL_DIR;
+    }
+    if( opts.limit_sub >= 0 ) {
+        lv->flags |= LEVEL_SUB;
+        chain.need_lock = 1;
+    }
+}
+
+static void * APR_THREAD_FUNC bench_thread( apr_thread_t *thd, void *data )
+{
+    bench_result *res = data;
+    dirlimit_engine eng = engine;
+    dirlimit_handle handles[3];
+    dirlimit_reqconfig rc;
+    apr_interval_time_t retry;
+    uint64_t seed, start, t, lat;
+    int k, ret, fail, fail_kind;
+    long i;
+
+    eng.lockstat = &res->lock;
+    seed = 0x9e3779b97f4a7c15ULL * (uint64_t)(res - results + 1);
+    memset( &rc, 0, sizeof(rc) );
+    rc.need_lock = chain.need_lock;
+    rc.handles = handles;
+
+    start = now_nsec();
+    for( i=0; i<opts.ops; i++ ) {
+        k = pick_key( &seed );
+        t = now_nsec();
+        ret = dirlimit_acquire( &eng, &chain, &keys[k], NULL, 1, &rc, &fail, &fail_kind, &retry );
+        if( ret == DIRLIMIT_OK ) {
+            lat = now_nsec() - t;
+            if( opts.hold_usec > 0 ) {
+                apr_sleep( opts.hold_usec );
+            }
+            t = now_nsec();
+            if( dirlimit_release( &eng, &rc, opts.hold_usec ) == DIRLIMIT_LOCKERROR ) {
+                res->lockerror++;
+            }
+            lat += now_nsec() - t;
+        } else {
+            lat = now_nsec() - t;
+            if( ret == DIRLIMIT_LOCKERROR ) {
+                res->lockerror++;
+            } else {
+                res->rejected++;
+            }
+        }
+        res->lat[ lat_bucket(lat) ]++;
+        if( lat > res->lat_max ) {
+            res->lat_max = lat;
+        }
+        res->ops++;
+    }
+    res->nsec = now_nsec() - start;
+    apr_thread_exit( thd, APR_SUCCESS );
+    return NULL;
+}
+
+static void run_child( int proc )
+{
+    apr_pool_t *p;
+    apr_thread_t **thds;
+    apr_status_t rv;
+    int i;
+
+    apr_pool_create( &p, NULL );
+    if( apr_global_mutex_child_init( &engine.mutex, NULL, p ) != APR_SUCCESS ) {
+        fprintf( stderr, "dirlimit_bench: mutex child_init failed\n" );
+        exit(1);
+    }
+    if( opts.lease > 0 ) {
+        dirlimit_engine_child_init( &engine, p );
+    }
+    thds = apr_palloc( p, sizeof(apr_thread_t*) * opts.threads );
+    for( i=0; i<opts.threads; i++ ) {
+        if( apr_thread_create( &thds[i], NULL, bench_thread,
+                &results[proc * opts.threads + i], p ) != APR_SUCCESS ) {
+            fprintf( stderr, "dirlimit_bench: thread create failed\n" );
+            exit(1);
+        }
+    }
+    for( i=0; i<opts.threads; i++ ) {
+        apr_thread_join( &rv, thds[i] );
+    }
+    /* returns the leases */
+    apr_pool_destroy( p );
+    exit(0);
+}
+
+static uint64_t percentile( const uint64_t *lat, uint64_t n, double q )
+{
+    uint64_t c = 0, want = (uint64_t)(n * q);
+    int b;
+
+    for( b=0; b<LAT_BUCKETS; b++ ) {
+        c += lat[b];
+        if( c > want ) {
+            return lat_value(b);
+        }
+    }
+    return lat_value(LAT_BUCKETS - 1);
+}
+
+static void report( void )
+{
+    bench_result total;
+    const bench_result *r;
+    uint64_t max_nsec = 0;
+    int i, b, n = opts.procs * opts.threads;
+
+    memset( &total, 0, sizeof(total) );
+    for( i=0; i<n; i++ ) {
+        r = &results[i];
+        total.ops += r->ops;
+        total.rejected += r->rejected;
+        total.lockerror += r->lockerror;
+        total.lock.locks += r->lock.locks;
+        total.lock.wait_nsec += r->lock.wait_nsec;
+        total.lock.hold_nsec += r->lock.hold_nsec;
+        if( r->lat_max > total.lat_max ) {
+            total.lat_max = r->lat_max;
+        }
+        if( r->nsec > max_nsec ) {
+            max_nsec = r->nsec;
+        }
+        for( b=0; b<LAT_BUCKETS; b++ ) {
+            total.lat[b] += r->lat[b];
+        }
+    }
+
+    printf( "procs: %d threads: %d keys: %d skew: %.2f limit: %d limit_sub: %d"
+        " table: %d hold(us): %d lease: %d\n",
+        opts.procs, opts.threads, opts.keys, opts.skew, opts.limit, opts.limit_sub,
+        opts.table_size, opts.hold_usec, opts.lease );
+    printf( "ops: %" APR_UINT64_T_FMT " rejected: %" APR_UINT64_T_FMT
+        " (%.2f%%) tablefull: %" APR_UINT64_T_FMT " lockerror: %" APR_UINT64_T_FMT "\n",
+        total.ops, total.rejected, total.ops ? 100.0 * total.rejected / total.ops : 0.0,
+        engine.shm->n_tablefull, total.lockerror );
+    printf( "ops/s: %.0f\n", max_nsec ? total.ops * 1e9 / max_nsec : 0.0 );
+    printf( "latency(ns): p50 %" APR_UINT64_T_FMT " p99 %" APR_UINT64_T_FMT
+        " p99.9 %" APR_UINT64_T_FMT " max %" APR_UINT64_T_FMT "\n",
+        percentile( total.lat, total.ops, 0.5 ), percentile( total.lat, total.ops, 0.99 ),
+        percentile( total.lat, total.ops, 0.999 ), total.lat_max );
+    printf( "lock: %" APR_UINT64_T_FMT " acquisitions, wait avg %.0f ns, hold avg %.0f ns"
+        ", hold total %.1f%% of run\n",
+        total.lock.locks,
+        total.lock.locks ? (double)total.lock.wait_nsec / total.lock.locks : 0.0,
+        total.lock.locks ? (double)total.lock.hold_nsec / total.lock.locks : 0.0,
+        max_nsec ? 100.0 * total.lock.hold_nsec / max_nsec : 0.0 );
+    printf( "counter: %u records: %u / %u\n",
+        (unsigned)engine.slots[0].counter, (unsigned)engine.shm->records_num,
+        (unsigned)engine.shm->records_size );
+}
+
+static void usage( void )
+{
+    fprintf( stderr, "usage: dirlimit_bench [-p procs] [-t threads] [-n ops per thread]"
+        " [-k keys] [-s zipf skew] [-l DirLimit] [-L DirLimitPerSub]"
+        " [-T DirLimitTableSize] [-h hold usec] [-e DirLimitLease batch]\n" );
+    exit(2);
+}
+
+int main( int argc, const char * const argv[] )
+{
+    apr_pool_t *p;
+    apr_getopt_t *opt;
+    apr_shm_t *shm, *res_shm;
+    apr_proc_t *procs;
+    apr_exit_why_e why;
+    const char *arg;
+    apr_size_t size;
+    char c;
+    int i, code;
+
+    apr_initialize();
+    atexit( apr_terminate );
+    apr_pool_create( &p, NULL );
+
+    apr_getopt_init( &opt, p, argc, argv );
+    while( apr_getopt( opt, "p:t:n:k:s:l:L:T:h:e:", &c, &arg ) == APR_SUCCESS ) {
+        switch( c ) {
+        case 'p': opts.procs = atoi(arg); break;
+        case 't': opts.threads = atoi(arg); break;
+        case 'n': opts.ops = atol(arg); break;
+        case 'k': opts.keys = atoi(arg); break;
+        case 's': opts.skew = atof(arg); break;
+        case 'l': opts.limit = atoi(arg); break;
+        case 'L': opts.limit_sub = atoi(arg); break;
+        case 'T': opts.table_size = atoi(arg); break;
+        case 'h': opts.hold_usec = atoi(arg); break;
+        case 'e': opts.lease = atoi(arg); break;
+        default: usage();
+        }
+    }
+    if( opts.procs < 1 || opts.threads < 1 || opts.keys < 1 || opts.table_size < 16 ) {
+        usage();
+    }
+
+    if( apr_global_mutex_create( &engine.mutex, NULL, APR_LOCK_DEFAULT, p ) != APR_SUCCESS ) {
+        fprintf( stderr, "dirlimit_bench: mutex create failed\n" );
+        return 1;
+    }
+    /* anonymous segments, inherited by the children */
+    size = dirlimit_engine_size( 1, opts.table_size, 16, opts.procs, 0 );
+    if( apr_shm_create( &shm, size, NULL, p ) != APR_SUCCESS ||
+            apr_shm_create( &res_shm, sizeof(bench_result) * opts.procs * opts.threads,
+                NULL, p ) != APR_SUCCESS ) {
+        fprintf( stderr, "dirlimit_bench: shm create failed\n" );
+        return 1;
+    }
+    dirlimit_engine_init( &engine, apr_shm_baseaddr_get(shm), 1, opts.table_size, 16,
+        opts.procs, 0 );
+    results = apr_shm_baseaddr_get(res_shm);
+    memset( results, 0, sizeof(bench_result) * opts.procs * opts.threads );
+    setup_keys( p );
+    setup_chain( p );
+
+    procs = apr_palloc( p, sizeof(apr_proc_t) * opts.procs );
+    for( i=0; i<opts.procs; i++ ) {
+        if( apr_proc_fork( &procs[i], p ) == APR_INCHILD ) {
+            run_child( i );
+        }
+    }
+    for( i=0; i<opts.procs; i++ ) {
+        apr_proc_wait( &procs[i], &code, &why, APR_WAIT );
+        if( why != APR_PROC_EXIT || code != 0 ) {
+            fprintf( stderr, "dirlimit_bench: child %d failed\n", i );
+        }
+    }
+
+    report();
+    apr_shm_destroy( res_shm );
+    apr_shm_destroy( shm );
+    return 0;
+}
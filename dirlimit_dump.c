@@ -0,0 +1,182 @@
+/*
+ * Dumps the shared memory segment of a running mod_dirlimit as JSON,
+ * without taking the global mutex of the request path.
+ *
+ *   dirlimit_dump [-i sec] shm_file
+ *
+ * shm_file is the DirLimitShmFile of the server. With -i a snapshot is
+ * written every <sec> seconds, one JSON object per line.
+ * The layout is described at dirlimit_shm_header in dirlimit_engine.h.
+ */
+#include "apr_general.h"
+#include "apr_getopt.h"
+#include "apr_shm.h"
+#include "apr_strings.h"
+#include "dirlimit_engine.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* how often to retry a copy that overlapped a writer before backing off */
+#define READ_TRIES      64
+#define READ_BACKOFF    1000    /* usec */
+#define READ_ROUNDS     1000
+
+static void print_string( const char *s )
+{
+    putchar( '"' );
+    for( ; *s; s++ ) {
+        if( *s == '"' || *s == '\\' ) {
+            printf( "\\%c", *s );
+        } else if( (unsigned char)*s < 0x20 ) {
+            printf( "\\u%04x", *s );
+        } else {
+            putchar( *s );
+        }
+    }
+    putchar( '"' );
+}
+
+static void print_stat( const char *name, const dirlimit_stat *st )
+{
+    printf( "\"%s\":{\"accepted\":%u,\"rejected\":%u,\"rate_rejected\":%u"
+        ",\"max_counter\":%u,\"hold_usec\":%" APR_UINT64_T_FMT "}",
+        name, st->accepted, st->rejected, st->rate_rejected, st->max_counter,
+        (apr_uint64_t)st->hold_usec );
+}
+
+static int dump( dirlimit_engine *eng, dirlimit_record *records, int *pos, char *names )
+{
+    dirlimit_shm_header *shm = eng->shm;
+    dirlimit_slot slot;
+    apr_uint32_t i;
+    int n, n_slots, round;
+
+    for( round=0; round<READ_ROUNDS; round++ ) {
+        if( (n = dirlimit_read_records( eng, records, pos, names, READ_TRIES )) >= 0 ) {
+            break;
+        }
+        apr_sleep( READ_BACKOFF );
+    }
+    if( n < 0 ) {
+        return -1;
+    }
+
+    printf( "{\"version\":%u,\"generation\":%u,\"time\":%" APR_TIME_T_FMT,
+        shm->version, shm->generation, apr_time_now() );
+    printf( ",\"total\":%" APR_UINT64_T_FMT ",\"rejected\":%" APR_UINT64_T_FMT
+        ",\"ratelimited\":%" APR_UINT64_T_FMT ",\"lockerror\":%" APR_UINT64_T_FMT
+        ",\"tablefull\":%" APR_UINT64_T_FMT ",\"clientfull\":%" APR_UINT64_T_FMT
+        ",\"namefull\":%" APR_UINT64_T_FMT,
+        (apr_uint64_t)shm->n_total, (apr_uint64_t)shm->n_rejected,
+        (apr_uint64_t)shm->n_ratelimited, (apr_uint64_t)shm->n_lockerror,
+        (apr_uint64_t)shm->n_tablefull, (apr_uint64_t)shm->n_clientfull,
+        (apr_uint64_t)shm->n_namefull );
+    printf( ",\"ownerfull\":%" APR_UINT64_T_FMT ",\"reaped\":%" APR_UINT64_T_FMT
+        ",\"reclaimed\":%" APR_UINT64_T_FMT, (apr_uint64_t)shm->n_ownerfull,
+        (apr_uint64_t)shm->n_reaped, (apr_uint64_t)shm->n_reclaimed );
+    printf( ",\"records_size\":%u,\"clients_num\":%u,\"clients_size\":%u",
+        shm->records_size, shm->clients_num, shm->clients_size );
+
+    /* per-dir counters are atomics, each read on its own; free slots are skipped */
+    printf( ",\"slots\":[" );
+    for( i=0, n_slots=0; i<shm->slots_num; i++ ) {
+        slot = eng->slots[i];
+        if( slot.ident == 0 ) {
+            continue;
+        }
+        printf( "%s{\"conf_id\":%u,\"claimed\":%u,\"generation\":%u,\"counter\":%u"
+            ",\"counter_script\":%u,\"waiters\":%u,\"limit_eff\":%u,", n_slots++ ? "," : "",
+            i, slot.claimed, slot.generation, slot.counter, slot.counter_script,
+            slot.waiters, slot.limit_eff );
+        printf( "\"reclaimed\":%u,\"reclaimed_lease\":%u,", slot.reclaimed,
+            slot.reclaimed_lease );
+        printf( "\"overridden\":%u,\"override\":[%d,%d,%d,%d],", slot.overridden,
+            slot.override[DIRLIMIT_OV_LIMIT], slot.override[DIRLIMIT_OV_LIMIT_SCRIPT],
+            slot.override[DIRLIMIT_OV_SUB], slot.override[DIRLIMIT_OV_SUB_SCRIPT] );
+        print_stat( "dir", &slot.dir );
+        putchar( ',' );
+        print_stat( "sub", &slot.sub );
+        putchar( ',' );
+        print_stat( "client", &slot.client );
+        putchar( '}' );
+    }
+
+    printf( "],\"records\":[" );
+    for( i=0; i<(apr_uint32_t)n; i++ ) {
+        printf( "%s{\"conf_id\":%d,\"pos\":%d,\"dirname\":", i ? "," : "",
+            records[i].conf_id, pos[i] );
+        if( dirlimit_record_name( names, &records[i] ) ) {
+            print_string( dirlimit_record_name( names, &records[i] ) );
+        } else {
+            printf( "null" );
+        }
+        printf( ",\"counter\":%d,\"counter_script\":%d,\"accepted\":%u,\"rejected\":%u"
+            ",\"max_counter\":%u}", records[i].counter, records[i].counter_script,
+            records[i].accepted, records[i].rejected, records[i].max_counter );
+    }
+    printf( "]}\n" );
+    fflush( stdout );
+    return 0;
+}
+
+static void usage( void )
+{
+    fprintf( stderr, "usage: dirlimit_dump [-i interval sec] shm_file\n" );
+    exit(2);
+}
+
+int main( int argc, const char * const argv[] )
+{
+    apr_pool_t *pool;
+    apr_getopt_t *opt;
+    apr_shm_t *shm;
+    dirlimit_engine eng;
+    dirlimit_record *records;
+    const char *arg;
+    char *names;
+    char c;
+    int *pos, interval = 0;
+
+    apr_initialize();
+    atexit( apr_terminate );
+    apr_pool_create( &pool, NULL );
+
+    apr_getopt_init( &opt, pool, argc, argv );
+    while( apr_getopt( opt, "i:", &c, &arg ) == APR_SUCCESS ) {
+        switch( c ) {
+        case 'i': interval = atoi(arg); break;
+        default: usage();
+        }
+    }
+    if( opt->ind != argc - 1 || interval < 0 ) {
+        usage();
+    }
+    if( apr_shm_attach( &shm, argv[opt->ind], pool ) != APR_SUCCESS ) {
+        fprintf( stderr, "dirlimit_dump: cannot attach %s\n", argv[opt->ind] );
+        return 1;
+    }
+    if( apr_shm_size_get( shm ) < sizeof(dirlimit_shm_header) ||
+            dirlimit_check_layout( apr_shm_baseaddr_get( shm ) ) != 0 ) {
+        fprintf( stderr, "dirlimit_dump: %s is not a segment of this version\n",
+            argv[opt->ind] );
+        return 1;
+    }
+    memset( &eng, 0, sizeof(eng) );
+    dirlimit_engine_attach( &eng, apr_shm_baseaddr_get( shm ) );
+    records = malloc( sizeof(dirlimit_record) * eng.shm->records_size );
+    pos = malloc( sizeof(int) * eng.shm->records_size );
+    names = malloc( eng.shm->names_size );
+
+    for(;;) {
+        if( dump( &eng, records, pos, names ) < 0 ) {
+            fprintf( stderr, "dirlimit_dump: the table stayed busy, no snapshot\n" );
+            return 1;
+        }
+        if( interval == 0 ) {
+            break;
+        }
+        apr_sleep( apr_time_from_sec(interval) );
+    }
+    return 0;
+}
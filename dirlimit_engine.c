@@ -0,0 +1,1778 @@
+#include "dirlimit_engine.h"
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+/* the mutex is held for well under a microsecond, apr_time_now() is too coarse */
+static inline uint64_t lock_clock( void )
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+    return (uint64_t)apr_time_now() * 1000;
+#endif
+}
+
+apr_status_t dirlimit_lock( dirlimit_engine *eng )
+{
+    dirlimit_lockstat *ls = eng->lockstat;
+    apr_status_t status;
+    uint64_t t;
+
+    if( ls == NULL ) {
+        status = apr_global_mutex_lock(eng->mutex);
+    } else {
+        t = lock_clock();
+        status = apr_global_mutex_lock(eng->mutex);
+        if( status == APR_SUCCESS ) {
+            ls->locked_at = lock_clock();
+            ls->wait_nsec += ls->locked_at - t;
+            ls->locks++;
+        }
+    }
+    if( status == APR_SUCCESS ) {
+        /* a holder that died left it odd; even it out, or no reader would ever succeed */
+        if( apr_atomic_read32(&eng->shm->seq) & 1 ) {
+            apr_atomic_inc32(&eng->shm->seq);
+        }
+        /* seqlock for the readers without the mutex, odd from here */
+        apr_atomic_inc32(&eng->shm->seq);
+    }
+    return status;
+}
+
+apr_status_t dirlimit_unlock( dirlimit_engine *eng )
+{
+    apr_atomic_inc32(&eng->shm->seq);
+    if( eng->lockstat ) {
+        eng->lockstat->hold_nsec += lock_clock() - eng->lockstat->locked_at;
+    }
+    return apr_global_mutex_unlock(eng->mutex);
+}
+
+/*
+ * Copy the used subdir records and their table positions without the
+ * global mutex, and the name arena into names (names_size bytes) unless
+ * NULL. Returns the number copied, or -1 if every one of the tries
+ * overlapped a writer.
+ */
+int dirlimit_read_records( dirlimit_engine *eng, dirlimit_record *dst, int *pos, char *names,
+    int tries )
+{
+    apr_uint32_t seq;
+    size_t i;
+    int n;
+
+    while( tries-- > 0 ) {
+        seq = apr_atomic_read32(&eng->shm->seq);
+        if( seq & 1 ) {
+            continue;
+        }
+        __sync_synchronize();
+        n = 0;
+        for( i=0; i<eng->shm->table_size && n<(int)eng->shm->records_size; i++ ) {
+            if( eng->records[i].conf_id < 0 ) {
+                continue;
+            }
+            dst[n] = eng->records[i];
+            pos[n] = i;
+            n++;
+        }
+        if( names ) {
+            memcpy( names, eng->names, eng->shm->names_size );
+        }
+        __sync_synchronize();
+        if( apr_atomic_read32(&eng->shm->seq) == seq ) {
+            return n;
+        }
+    }
+    return -1;
+}
+
+/* 0 if the segment was laid out by this version of the engine */
+int dirlimit_check_layout( const dirlimit_shm_header *shm )
+{
+    if( shm->magic != DIRLIMIT_SHM_MAGIC || shm->version != DIRLIMIT_SHM_VERSION ) {
+        return -1;
+    }
+    if( shm->header_size != SHM_HEADER_SIZE || shm->slot_size != sizeof(dirlimit_slot) ||
+            shm->record_size != sizeof(dirlimit_record) ||
+            shm->client_size != sizeof(dirlimit_client) ) {
+        return -1;
+    }
+    return 0;
+}
+
+static inline size_t table_size_for( size_t size )
+{
+    size_t n;
+    for( n = 1; n < size * 2; ) {
+        n <<= 1;
+    }
+    return n;
+}
+
+/* the arena is a power of 2, at least DIRLIMIT_NAME_BYTES a record */
+static inline int names_top_for( int records_size )
+{
+    int top;
+    for( top = 0; top < DIRLIMIT_NAME_CLASSES - 1 &&
+            (16U << top) < (apr_uint32_t)records_size * DIRLIMIT_NAME_BYTES; top++ ) {
+    }
+    return top;
+}
+
+apr_size_t dirlimit_engine_size( int slots_num, int records_size, int clients_size,
+    int procs_num, int owners_num )
+{
+    return SHM_HEADER_SIZE + sizeof(dirlimit_slot) * slots_num
+        + sizeof(dirlimit_record) * table_size_for( records_size )
+        + sizeof(dirlimit_client) * table_size_for( clients_size )
+        + sizeof(dirlimit_owner) * owners_num
+        + (sizeof(dirlimit_proc) + sizeof(uint64_t) * slots_num * 2) * procs_num
+        + ((apr_size_t)17 << names_top_for( records_size ));     /* arena and its map */
+}
+
+/* set up the process-local pointers into the segment */
+void dirlimit_engine_attach( dirlimit_engine *eng, void *base )
+{
+    dirlimit_shm_header *shm = base;
+
+    eng->shm = shm;
+    eng->slots = (dirlimit_slot*)((char*)shm + shm->slots_offset);
+    eng->records = (dirlimit_record*)((char*)shm + shm->records_offset);
+    eng->clients = (dirlimit_client*)((char*)shm + shm->clients_offset);
+    eng->names = (char*)shm + shm->names_offset;
+    eng->names_map = (unsigned char*)shm + shm->names_map_offset;
+    eng->owners = (dirlimit_owner*)((char*)shm + shm->owners_offset);
+    eng->procs = (dirlimit_proc*)((char*)shm + shm->procs_offset);
+}
+
+/* base must hold dirlimit_engine_size() bytes */
+void dirlimit_engine_init( dirlimit_engine *eng, void *base,
+    int slots_num, int records_size, int clients_size, int procs_num, int owners_num )
+{
+    dirlimit_shm_header *shm = base;
+    size_t i;
+
+    memset( shm, 0, dirlimit_engine_size( slots_num, records_size, clients_size,
+        procs_num, owners_num ) );
+    shm->version = DIRLIMIT_SHM_VERSION;
+    shm->header_size = SHM_HEADER_SIZE;
+    shm->slot_size = sizeof(dirlimit_slot);
+    shm->record_size = sizeof(dirlimit_record);
+    shm->client_size = sizeof(dirlimit_client);
+    shm->slots_num = slots_num;
+    shm->slots_offset = SHM_HEADER_SIZE;
+    shm->table_size = table_size_for( records_size );
+    shm->records_size = records_size;
+    shm->records_offset = shm->slots_offset + sizeof(dirlimit_slot) * slots_num;
+    shm->clients_table_size = table_size_for( clients_size );
+    shm->clients_size = clients_size;
+    shm->clients_offset = shm->records_offset + sizeof(dirlimit_record) * shm->table_size;
+    shm->owners_num = owners_num;
+    shm->owners_offset = shm->clients_offset + sizeof(dirlimit_client) * shm->clients_table_size;
+    shm->procs_num = procs_num;
+    shm->procs_offset = shm->owners_offset + sizeof(dirlimit_owner) * owners_num;
+    shm->leases_offset = shm->procs_offset + sizeof(dirlimit_proc) * procs_num;
+    shm->names_top = names_top_for( records_size );
+    shm->names_size = 16U << shm->names_top;
+    shm->names_offset = shm->leases_offset + sizeof(uint64_t) * slots_num * 2 * procs_num;
+    shm->names_map_offset = shm->names_offset + shm->names_size;
+    dirlimit_engine_attach( eng, base );
+
+    /* the arena starts as one free chunk */
+    for( i=0; i<DIRLIMIT_NAME_CLASSES; i++ ) {
+        shm->names_free[i] = DIRLIMIT_NO_NAME;
+    }
+    memset( eng->names, 0xff, sizeof(apr_uint32_t) * 2 );      /* no next, no prev */
+    shm->names_free[shm->names_top] = 0;
+    eng->names_map[0] = shm->names_top + 1;
+
+    for( i=0; i<shm->table_size; i++ ) {
+        eng->records[i].conf_id = -1;
+    }
+    for( i=0; i<shm->clients_table_size; i++ ) {
+        eng->clients[i].conf_id = -1;
+    }
+    /* last, a reader polling the file sees a complete layout */
+    __sync_synchronize();
+    shm->magic = DIRLIMIT_SHM_MAGIC;
+}
+
+/* FNV-1a over conf_id and dirname, 64bit so that the name is rarely compared */
+uint64_t dirlimit_hash_record( int conf_id, const char *dirname, int len )
+{
+    uint64_t h = 14695981039346656037ULL;
+    const unsigned char *p;
+    int i;
+
+    for( i=0; i<(int)sizeof(conf_id); i++ ) {
+        h ^= (conf_id >> (i*8)) & 0xff;
+        h *= 1099511628211ULL;
+    }
+    for( p = (const unsigned char*)dirname; p < (const unsigned char*)dirname + len; p++ ) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/*
+ * Open addressing with linear probing.
+ * On miss, *pos is the empty slot where the key should be inserted.
+ */
+static int search_record( dirlimit_engine *eng, const dirlimit_key *key, size_t *pos )
+{
+    dirlimit_record *rs = eng->records;
+    size_t mask = eng->shm->table_size - 1;
+    size_t i;
+
+    for( i = key->hash & mask; rs[i].conf_id >= 0; i = (i+1) & mask ) {
+        if( rs[i].hash == key->hash && rs[i].conf_id == key->conf_id &&
+                rs[i].name_len == (apr_uint32_t)key->dirname_len &&
+                (rs[i].name_off == DIRLIMIT_NO_NAME ||
+                memcmp( key->dirname, eng->names + rs[i].name_off, key->dirname_len ) == 0) ) {
+            *pos = i;
+            return 1;
+        }
+    }
+    *pos = i;
+    return 0;
+}
+
+/*
+ * The name arena is a buddy allocator over chunks of 16 << class bytes.
+ * A free chunk starts with its list links, and the map holds class + 1
+ * at the 16-byte unit it starts at, so that a freed chunk finds its buddy.
+ */
+typedef struct {
+    apr_uint32_t next;
+    apr_uint32_t prev;
+} dirlimit_name_link;
+
+static inline dirlimit_name_link *name_link( dirlimit_engine *eng, apr_uint32_t off )
+{
+    return (dirlimit_name_link*)(eng->names + off);
+}
+
+static void push_name( dirlimit_engine *eng, apr_uint32_t off, int cls )
+{
+    dirlimit_shm_header *shm = eng->shm;
+
+    name_link( eng, off )->next = shm->names_free[cls];
+    name_link( eng, off )->prev = DIRLIMIT_NO_NAME;
+    if( shm->names_free[cls] != DIRLIMIT_NO_NAME ) {
+        name_link( eng, shm->names_free[cls] )->prev = off;
+    }
+    shm->names_free[cls] = off;
+    eng->names_map[off / 16] = cls + 1;
+}
+
+static void unlink_name( dirlimit_engine *eng, apr_uint32_t off, int cls )
+{
+    dirlimit_name_link *l = name_link( eng, off );
+
+    if( l->prev != DIRLIMIT_NO_NAME ) {
+        name_link( eng, l->prev )->next = l->next;
+    } else {
+        eng->shm->names_free[cls] = l->next;
+    }
+    if( l->next != DIRLIMIT_NO_NAME ) {
+        name_link( eng, l->next )->prev = l->prev;
+    }
+    eng->names_map[off / 16] = 0;
+}
+
+/* -1 if no chunk is large enough; the record then keeps only the hash */
+static int alloc_name( dirlimit_engine *eng, dirlimit_record *rec, const char *name, int len )
+{
+    dirlimit_shm_header *shm = eng->shm;
+    apr_uint32_t off;
+    int cls, c;
+
+    for( cls = 0; cls <= (int)shm->names_top && (16U << cls) <= (apr_uint32_t)len; cls++ ) {
+    }
+    for( c = cls; c <= (int)shm->names_top && shm->names_free[c] == DIRLIMIT_NO_NAME; c++ ) {
+    }
+    if( c > (int)shm->names_top ) {
+        return -1;
+    }
+    off = shm->names_free[c];
+    unlink_name( eng, off, c );
+    /* split down, the upper halves go to the free lists */
+    while( c > cls ) {
+        c--;
+        push_name( eng, off + (16U << c), c );
+    }
+    memcpy( eng->names + off, name, len );
+    eng->names[off + len] = '\0';
+    rec->name_off = off;
+    rec->name_class = cls;
+    return 0;
+}
+
+static void free_name( dirlimit_engine *eng, dirlimit_record *rec )
+{
+    apr_uint32_t off = rec->name_off, buddy;
+    int cls = rec->name_class;
+
+    if( off == DIRLIMIT_NO_NAME ) {
+        return;
+    }
+    /* merge while the buddy is a free chunk of the same class */
+    while( cls < (int)eng->shm->names_top ) {
+        buddy = off ^ (16U << cls);
+        if( eng->names_map[buddy / 16] != cls + 1 ) {
+            break;
+        }
+        unlink_name( eng, buddy, cls );
+        off &= ~(16U << cls);
+        cls++;
+    }
+    push_name( eng, off, cls );
+    rec->name_off = DIRLIMIT_NO_NAME;
+}
+
+/* -1 if the table is full */
+static int insert_record( dirlimit_engine *eng, const dirlimit_key *key, size_t pos )
+{
+    dirlimit_record *rs = eng->records;
+
+    if( eng->shm->records_num >= eng->shm->records_size ) {
+        return -1;
+    }
+    /* without room for the name, the 64bit hash alone tells the records apart */
+    if( alloc_name( eng, &rs[pos], key->dirname, key->dirname_len ) != 0 ) {
+        rs[pos].name_off = DIRLIMIT_NO_NAME;
+        ATOMIC_INC64(&eng->shm->n_namefull);
+    }
+    rs[pos].name_len = key->dirname_len;
+    rs[pos].conf_id = key->conf_id;
+    rs[pos].hash = key->hash;
+    if( ++eng->shm->record_gen == 0 ) {
+        eng->shm->record_gen = 1;
+    }
+    rs[pos].gen = eng->shm->record_gen;
+    rs[pos].counter = 0;
+    rs[pos].counter_script = 0;
+    memset( rs[pos].reserved, 0, sizeof(rs[pos].reserved) );
+    rs[pos].bw_tat = 0;
+    rs[pos].bw_tat_script = 0;
+    rs[pos].rate_tat = 0;
+    eng->shm->records_num++;
+    return 0;
+}
+
+/* backward-shift deletion, no tombstones */
+static void remove_record( dirlimit_engine *eng, size_t pos )
+{
+    dirlimit_record *rs = eng->records;
+    size_t mask = eng->shm->table_size - 1;
+    size_t i, j, home;
+    
+    free_name( eng, &rs[pos] );
+    i = pos;
+    for( j = (i+1) & mask; rs[j].conf_id >= 0; j = (j+1) & mask ) {
+        home = rs[j].hash & mask;
+        /* rs[j] may move to i only if its home is not in (i, j] */
+        if( ((j - home) & mask) >= ((j - i) & mask) ) {
+            rs[i] = rs[j];
+            i = j;
+        }
+    }
+    rs[i].conf_id = -1;
+    rs[i].name_off = DIRLIMIT_NO_NAME;
+    rs[i].name_len = 0;
+    eng->shm->records_num--;
+}
+
+/*
+ * A record without requests is kept while its rate or bandwidth state is
+ * still ahead of the clock, or a new record would start with a full bucket.
+ */
+static inline int record_idle( const dirlimit_record *rec, uint64_t now )
+{
+    return rec->counter == 0 && rec->counter_script == 0 &&
+        rec->rate_tat <= now && rec->bw_tat <= now && rec->bw_tat_script <= now;
+}
+
+#define SWEEP_PROBE                 64  /* buckets swept when an insert finds the table full */
+
+/*
+ * Drop the idle records in the buckets from *pos on, and leave *pos after
+ * them, so that a caller can go round the table a step at a time.
+ * Global mutex must be held.
+ */
+int dirlimit_sweep( dirlimit_engine *eng, size_t *pos, size_t buckets )
+{
+    dirlimit_record *rs = eng->records;
+    uint64_t now = (uint64_t)apr_time_now() * 1000;
+    size_t i, mask = eng->shm->table_size - 1;
+    int n = 0;
+
+    if( buckets > eng->shm->table_size ) {
+        buckets = eng->shm->table_size;
+    }
+    for( i = *pos & mask; buckets > 0; ) {
+        if( rs[i].conf_id >= 0 && record_idle( &rs[i], now ) ) {
+            /* the next record may have been shifted into i */
+            remove_record( eng, i );
+            n++;
+            continue;
+        }
+        i = (i+1) & mask;
+        buckets--;
+    }
+    *pos = i;
+    return n;
+}
+
+/* 64bit FNV-1a over a nul terminated string */
+static uint64_t hash_string( const char *str )
+{
+    uint64_t h = 14695981039346656037ULL;
+    const unsigned char *p;
+
+    for( p = (const unsigned char*)str; *p; p++ ) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* the client address, 64bit so that collisions can be ignored */
+uint64_t dirlimit_hash_client( const char *addr )
+{
+    return hash_string( addr );
+}
+
+/*
+ * The identity of a config section across restarts, never 0 so that 0
+ * can mark an unused registry slot.
+ */
+uint64_t dirlimit_hash_ident( const char *ident )
+{
+    uint64_t h = hash_string( ident );
+
+    return h ? h : 1;
+}
+
+/* the client table works as the subdir one, under the global mutex */
+static int search_client( dirlimit_engine *eng, int conf_id, uint64_t hash, size_t *pos )
+{
+    dirlimit_client *cs = eng->clients;
+    size_t mask = eng->shm->clients_table_size - 1;
+    size_t i;
+
+    hash ^= (uint64_t)conf_id * 0x9e3779b97f4a7c15ULL;
+    for( i = hash & mask; cs[i].conf_id >= 0; i = (i+1) & mask ) {
+        if( cs[i].hash == hash && cs[i].conf_id == conf_id ) {
+            *pos = i;
+            return 1;
+        }
+    }
+    *pos = i;
+    return 0;
+}
+
+static void insert_client( dirlimit_engine *eng, int conf_id, uint64_t hash, size_t pos )
+{
+    dirlimit_client *cs = eng->clients;
+
+    cs[pos].hash = hash ^ (uint64_t)conf_id * 0x9e3779b97f4a7c15ULL;
+    cs[pos].conf_id = conf_id;
+    if( ++eng->shm->client_gen == 0 ) {
+        eng->shm->client_gen = 1;
+    }
+    cs[pos].gen = eng->shm->client_gen;
+    cs[pos].counter = 0;
+    cs[pos].counter_script = 0;
+    eng->shm->clients_num++;
+}
+
+/* backward-shift deletion; an entry goes as soon as its counters are 0 */
+static void remove_client( dirlimit_engine *eng, size_t pos )
+{
+    dirlimit_client *cs = eng->clients;
+    size_t mask = eng->shm->clients_table_size - 1;
+    size_t i, j, home;
+
+    i = pos;
+    for( j = (i+1) & mask; cs[j].conf_id >= 0; j = (j+1) & mask ) {
+        home = cs[j].hash & mask;
+        if( ((j - home) & mask) >= ((j - i) & mask) ) {
+            cs[i] = cs[j];
+            i = j;
+        }
+    }
+    cs[i].conf_id = -1;
+    eng->shm->clients_num--;
+}
+
+/*
+ * 1 if no request holds a counter of the config, so its slot can go to
+ * another scope after a restart. Global mutex must be held.
+ */
+int dirlimit_conf_idle( dirlimit_engine *eng, int conf_id )
+{
+    dirlimit_slot *slot = &eng->slots[conf_id];
+    size_t i;
+
+    if( apr_atomic_read32(&slot->counter) || apr_atomic_read32(&slot->counter_script) ||
+            apr_atomic_read32(&slot->waiters) ) {
+        return 0;
+    }
+    for( i=0; i<eng->shm->table_size; i++ ) {
+        if( eng->records[i].conf_id == conf_id &&
+                (eng->records[i].counter || eng->records[i].counter_script) ) {
+            return 0;
+        }
+    }
+    for( i=0; i<eng->shm->clients_table_size; i++ ) {
+        if( eng->clients[i].conf_id == conf_id ) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* drop all state of an idle config; global mutex must be held */
+void dirlimit_reset_conf( dirlimit_engine *eng, int conf_id )
+{
+    dirlimit_slot *slot = &eng->slots[conf_id];
+    size_t i;
+
+    for( i=0; i<eng->shm->table_size; ) {
+        if( eng->records[i].conf_id == conf_id ) {
+            /* the next record may have been shifted into i */
+            remove_record( eng, i );
+            continue;
+        }
+        i++;
+    }
+    if( slot->overridden ) {
+        apr_atomic_dec32(&eng->shm->overrides);
+    }
+    memset( slot, 0, sizeof(*slot) );
+}
+
+static inline void update_max( volatile apr_uint32_t *max, apr_uint32_t v )
+{
+    apr_uint32_t m;
+    do {
+        m = apr_atomic_read32(max);
+    } while( m < v && apr_atomic_cas32(max, v, m) != m );
+}
+
+static inline int hist_bucket( apr_interval_time_t usec )
+{
+    apr_interval_time_t ms = usec / 1000;
+    int b = 0;
+    while( ms > 0 && b < HIST_BUCKETS-1 ) {
+        ms >>= 1;
+        b++;
+    }
+    return b;
+}
+
+/* the script counts are a subset, for the split in dirlimit-metrics */
+static inline void count_accepted( dirlimit_stat *st, const char *type )
+{
+    apr_atomic_inc32(&st->accepted);
+    if( type == SCRIPT_TYPE ) {
+        apr_atomic_inc32(&st->accepted_script);
+    }
+}
+
+void dirlimit_count_rejection( dirlimit_engine *eng, int conf_id, int kind, const char *type )
+{
+    dirlimit_stat *st = stat_of( &eng->slots[conf_id], kind );
+
+    ATOMIC_INC64(&eng->shm->n_rejected);
+    apr_atomic_inc32(&st->rejected);
+    if( type == SCRIPT_TYPE ) {
+        apr_atomic_inc32(&st->rejected_script);
+    }
+}
+
+static void count_rate_rejection( dirlimit_engine *eng, int conf_id, int kind )
+{
+    ATOMIC_INC64(&eng->shm->n_ratelimited);
+    apr_atomic_inc32(&stat_of( &eng->slots[conf_id], kind )->rate_rejected);
+}
+
+/*
+ * DirLimitReserve: the last reserve_total units of a limit are held back
+ * for the classes. A request takes the general share first, then the pool
+ * of its class, then those of the classes listed after it.
+ * Returns the pool taken, -1 for the general share, or -2 if none is left.
+ * Global mutex must be held.
+ */
+static int take_reserve( dirlimit_record *rec, int limit, const dirlimit_level *lv, int cls )
+{
+    int k, general;
+
+    general = rec->counter;
+    for( k=0; k<DIRLIMIT_CLASSES; k++ ) {
+        general -= rec->reserved[k];
+    }
+    if( general < limit - lv->reserve_total ) {
+        return -1;
+    }
+    for( k = cls < 0 ? DIRLIMIT_CLASSES : cls; k<DIRLIMIT_CLASSES; k++ ) {
+        if( rec->reserved[k] < lv->reserve[k] && rec->counter < limit ) {
+            rec->reserved[k]++;
+            return k;
+        }
+    }
+    return -2;
+}
+
+static int check_limit( dirlimit_engine *eng, const dirlimit_key *r, const dirlimit_level *lv,
+    int limit, int cls, const char* type, int count, dirlimit_handle *h )
+{
+    size_t ret, pos, from;
+    int pool = -2;
+
+    ret = search_record( eng, r, &pos );
+    if( ! ret && insert_record( eng, r, pos ) != 0 ) {
+        /*
+         * Only around the probe: a table full of live records would make
+         * every new subdir scan all of it under the mutex. The idle ones
+         * elsewhere go with the sweep of the parent.
+         */
+        from = r->hash;
+        if( dirlimit_sweep( eng, &from, SWEEP_PROBE ) > 0 ) {
+            search_record( eng, r, &pos );
+        }
+        if( insert_record( eng, r, pos ) != 0 ) {
+            /* a DirLimitWait retry is not another rejection */
+            if( count ) {
+                ATOMIC_INC64(&eng->shm->n_tablefull);
+                ATOMIC_INC64(&eng->shm->n_rejected);
+            }
+            return -1;
+        }
+    }
+    if( type == SCRIPT_TYPE ) {
+        if( limit >= 0 && eng->records[pos].counter_script >= limit ) {
+            goto rejected;
+        }
+        (eng->records[pos].counter_script)++;
+        ret = eng->records[pos].counter_script;
+    } else if( limit >= 0 && lv->reserve_total > 0 ) {
+        pool = take_reserve( &eng->records[pos], limit, lv, cls );
+        if( pool < -1 ) {
+            goto rejected;
+        }
+        if( pool >= 0 ) {
+            ATOMIC_INC64(&eng->slots[r->conf_id].reserve_taken);
+        }
+        (eng->records[pos].counter)++;
+        ret = eng->records[pos].counter;
+    } else {
+        if( limit >= 0 && eng->records[pos].counter >= limit ) {
+            goto rejected;
+        }
+        (eng->records[pos].counter)++;
+        ret = eng->records[pos].counter;
+    }
+    eng->records[pos].accepted++;
+    if( (apr_uint32_t)ret > eng->records[pos].max_counter ) {
+        eng->records[pos].max_counter = ret;
+    }
+    count_accepted( &eng->slots[r->conf_id].sub, type );
+    update_max( &eng->slots[r->conf_id].sub.max_counter, ret );
+    h->conf_id = r->conf_id;
+    h->kind = LEVEL_SUB;
+    h->pool = pool;
+    h->pos = pos;
+    h->gen = eng->records[pos].gen;
+    h->hash = r->hash;
+    return ret;
+
+rejected:
+    /* counted only; the parent logs a summary every DirLimitLogInterval */
+    if( count ) {
+        dirlimit_count_rejection( eng, r->conf_id, LEVEL_SUB, type );
+        eng->records[pos].rejected++;
+    }
+    if( record_idle( &eng->records[pos], (uint64_t)apr_time_now() * 1000 ) ) {
+        remove_record( eng, pos );
+    }
+    return -1;
+}
+
+/*
+ * Returns 0 without a handle when the client table is full: an address
+ * churning client must not lock everyone else out of the scope.
+ */
+static int check_client( dirlimit_engine *eng, int conf_id, uint64_t hash, int limit,
+    const char* type, int count, dirlimit_handle *h )
+{
+    dirlimit_client *c;
+    size_t pos;
+    int ret;
+
+    if( ! search_client( eng, conf_id, hash, &pos ) ) {
+        if( eng->shm->clients_num >= eng->shm->clients_size ) {
+            ATOMIC_INC64(&eng->shm->n_clientfull);
+            return 0;
+        }
+        insert_client( eng, conf_id, hash, pos );
+    }
+    c = &eng->clients[pos];
+    if( type == SCRIPT_TYPE ) {
+        if( limit >= 0 && c->counter_script >= limit ) {
+            goto rejected;
+        }
+        ret = ++(c->counter_script);
+    } else {
+        if( limit >= 0 && c->counter >= limit ) {
+            goto rejected;
+        }
+        ret = ++(c->counter);
+    }
+    count_accepted( &eng->slots[conf_id].client, type );
+    update_max( &eng->slots[conf_id].client.max_counter, ret );
+    h->conf_id = conf_id;
+    h->kind = LEVEL_CLIENT;
+    h->pool = -2;
+    h->pos = pos;
+    h->gen = c->gen;
+    h->hash = (apr_uint32_t)c->hash;
+    return ret;
+
+rejected:
+    if( count ) {
+        dirlimit_count_rejection( eng, conf_id, LEVEL_CLIENT, type );
+    }
+    if( c->counter == 0 && c->counter_script == 0 ) {
+        remove_client( eng, pos );
+    }
+    return -1;
+}
+
+/* lock-free "increment if below limit" on the per-dir slot */
+static int acquire_slot( dirlimit_engine *eng, int conf_id, int limit, const char* type, int count )
+{
+    volatile apr_uint32_t *counter;
+    apr_uint32_t c;
+
+    counter = &(eng->slots[conf_id].counter);
+    if( type == SCRIPT_TYPE ) {
+        counter = &(eng->slots[conf_id].counter_script);
+    }
+    do {
+        c = apr_atomic_read32(counter);
+        if( limit >= 0 && c >= (apr_uint32_t)limit ) {
+            if( count ) {
+                dirlimit_count_rejection( eng, conf_id, LEVEL_DIR, type );
+            }
+            return -1;
+        }
+    } while( apr_atomic_cas32(counter, c+1, c) != c );
+    count_accepted( &eng->slots[conf_id].dir, type );
+    update_max( &eng->slots[conf_id].dir.max_counter, c+1 );
+    return c+1;
+}
+
+static int release_counter( volatile apr_uint32_t *counter )
+{
+    apr_uint32_t c;
+
+    do {
+        c = apr_atomic_read32(counter);
+        if( c == 0 ) {
+            return -1;
+        }
+    } while( apr_atomic_cas32(counter, c-1, c) != c );
+    return 0;
+}
+
+static int release_slot( dirlimit_engine *eng, int conf_id, const char* type )
+{
+    if( type == SCRIPT_TYPE ) {
+        return release_counter( &eng->slots[conf_id].counter_script );
+    }
+    return release_counter( &eng->slots[conf_id].counter );
+}
+
+/*
+ * DirLimitAdaptive: AIMD on the per-dir limit, fed by the hold times.
+ * Every limit_eff releases close a window. If its average is well above
+ * the baseline, requests are queueing behind a slow backend and the limit
+ * backs off by 10%; otherwise it grows by one if the window hit it.
+ * The baseline follows the fastest windows and drifts up slowly, so that
+ * a lasting change of the backend is accepted in the end.
+ */
+#define ADAPT_TOLERANCE             2
+#define ADAPT_DRIFT                 64
+
+static void adapt_limit( dirlimit_slot *slot, apr_interval_time_t hold )
+{
+    apr_uint32_t n, lim, next;
+    uint64_t usec, avg, base;
+
+    ATOMIC_ADD64(&slot->adapt_usec, (uint64_t)hold);
+    n = apr_atomic_inc32(&slot->adapt_count) + 1;
+    lim = apr_atomic_read32(&slot->limit_eff);
+    /* only the release that resets the window adjusts */
+    if( n < lim || apr_atomic_cas32(&slot->adapt_count, 0, n) != n ) {
+        return;
+    }
+    usec = slot->adapt_usec;
+    ATOMIC_SUB64(&slot->adapt_usec, usec);
+    avg = usec / n;
+
+    base = slot->adapt_base_usec;
+    if( base == 0 || avg < base ) {
+        base = avg;
+    } else {
+        base += (avg - base) / ADAPT_DRIFT;
+    }
+    slot->adapt_base_usec = base;
+
+    next = lim;
+    if( avg > base * ADAPT_TOLERANCE ) {
+        next = lim - (lim / 10 > 0 ? lim / 10 : 1);
+    } else if( slot->adapt_full ) {
+        next = lim + 1;
+    }
+    if( next < slot->adapt_min ) {
+        next = slot->adapt_min;
+    } else if( next > slot->adapt_max ) {
+        next = slot->adapt_max;
+    }
+    if( next != lim ) {
+        apr_atomic_set32(&slot->limit_eff, next);
+        apr_atomic_inc32( next > lim ? &slot->adapt_up : &slot->adapt_down );
+    }
+    apr_atomic_set32(&slot->adapt_full, 0);
+}
+
+/* max 0 turns DirLimitAdaptive off */
+void dirlimit_set_adaptive( dirlimit_engine *eng, int conf_id, int min, int max )
+{
+    dirlimit_slot *slot = &eng->slots[conf_id];
+
+    slot->adapt_min = min;
+    slot->adapt_max = max;
+    /* start wide open, the first slow window backs off; kept through a restart */
+    if( max > 0 && (slot->limit_eff < (apr_uint32_t)min || slot->limit_eff > (apr_uint32_t)max) ) {
+        slot->limit_eff = max;
+    }
+}
+
+/*
+ * DirLimitLease: a child takes capacity from the slot counter in batches
+ * and admits its own requests from them with process-local atomics, so
+ * the shared cache line is touched only to refill or give back a lease.
+ * The word holds the leased units in the upper and the requests in flight
+ * in the lower 32 bits, so a lease is never returned while still in use.
+ * The slot counter then counts leased units, the limit stays exact.
+ */
+#define LEASE_HELD(v)   ((apr_uint32_t)((v) >> 32))
+#define LEASE_USED(v)   ((apr_uint32_t)((v) & 0xffffffff))
+
+static inline volatile uint64_t *lease_of( dirlimit_engine *eng, int conf_id, const char *type )
+{
+    return &eng->leases[ conf_id * 2 + (type == SCRIPT_TYPE) ];
+}
+
+/* take up to n units from the slot counter, fewer near the limit */
+static apr_uint32_t take_units( volatile apr_uint32_t *counter, int limit, apr_uint32_t n )
+{
+    apr_uint32_t c, g;
+
+    do {
+        c = apr_atomic_read32(counter);
+        if( c >= (apr_uint32_t)limit ) {
+            return 0;
+        }
+        g = (apr_uint32_t)limit - c < n ? (apr_uint32_t)limit - c : n;
+    } while( apr_atomic_cas32(counter, c+g, c) != c );
+    return g;
+}
+
+/*
+ * DirLimitReserve on the per-dir slot, as take_reserve() does for records.
+ * The general share and the pools are counted apart; counter keeps the
+ * total for the status, DirLimitWait and DirLimitAdaptive.
+ */
+static int acquire_reserve( dirlimit_engine *eng, const dirlimit_level *lv, int limit,
+    int cls, int count, int *pool )
+{
+    dirlimit_slot *slot = &eng->slots[lv->conf_id];
+    apr_uint32_t c;
+    int k;
+
+    *pool = -1;
+    if( limit <= lv->reserve_total ||
+            take_units( &slot->general, limit - lv->reserve_total, 1 ) == 0 ) {
+        for( k = cls < 0 ? DIRLIMIT_CLASSES : cls; k<DIRLIMIT_CLASSES; k++ ) {
+            /* an adaptive limit may have shrunk below the reserves */
+            if( lv->reserve[k] > 0 && apr_atomic_read32(&slot->counter) < (apr_uint32_t)limit &&
+                    take_units( &slot->reserved[k], lv->reserve[k], 1 ) > 0 ) {
+                break;
+            }
+        }
+        if( k == DIRLIMIT_CLASSES ) {
+            if( count ) {
+                dirlimit_count_rejection( eng, lv->conf_id, LEVEL_DIR, NO_SCRIPT_TYPE );
+            }
+            return -1;
+        }
+        *pool = k;
+        ATOMIC_INC64(&slot->reserve_taken);
+    }
+    c = apr_atomic_inc32(&slot->counter) + 1;
+    count_accepted( &slot->dir, NO_SCRIPT_TYPE );
+    update_max( &slot->dir.max_counter, c );
+    return c;
+}
+
+static inline volatile uint64_t *lease_row( dirlimit_engine *eng, int proc )
+{
+    return (volatile uint64_t*)((char*)eng->shm + eng->shm->leases_offset) +
+        (size_t)proc * eng->shm->slots_num * 2;
+}
+
+/* requests in flight on the leases of every child, for the high-water mark */
+static apr_uint32_t leased_in_use( dirlimit_engine *eng, int conf_id, const char *type )
+{
+    int i, j = conf_id * 2 + (type == SCRIPT_TYPE);
+    apr_uint32_t n = 0;
+
+    for( i=0; i<(int)eng->shm->procs_num; i++ ) {
+        if( i != eng->proc && apr_atomic_read32(&eng->procs[i].pid) != 0 ) {
+            n += LEASE_USED(lease_row( eng, i )[j]);
+        }
+    }
+    /* ours, also when it lives in process memory */
+    return n + LEASE_USED(eng->leases[j]);
+}
+
+static int acquire_leased( dirlimit_engine *eng, int conf_id, int limit, const char* type,
+    apr_uint32_t batch, int count )
+{
+    dirlimit_slot *slot = &eng->slots[conf_id];
+    volatile uint64_t *lease = lease_of( eng, conf_id, type );
+    volatile apr_uint32_t *counter;
+    apr_uint32_t g;
+    uint64_t v;
+
+    counter = (type == SCRIPT_TYPE) ? &slot->counter_script : &slot->counter;
+    for(;;) {
+        v = *lease;
+        if( LEASE_USED(v) < LEASE_HELD(v) ) {
+            if( ATOMIC_CAS64( lease, v+1, v ) == v ) {
+                break;
+            }
+            continue;
+        }
+        g = take_units( counter, limit, batch );
+        if( g == 0 ) {
+            /* another thread may have refilled meanwhile */
+            v = *lease;
+            if( LEASE_USED(v) < LEASE_HELD(v) ) {
+                continue;
+            }
+            if( count ) {
+                dirlimit_count_rejection( eng, conf_id, LEVEL_DIR, type );
+            }
+            return -1;
+        }
+        ATOMIC_ADD64( lease, (uint64_t)g << 32 );
+        apr_atomic_inc32(&slot->lease_refill);
+    }
+    count_accepted( &slot->dir, type );
+    /* in use never exceeds the units leased, so the rows are scanned only below them */
+    if( apr_atomic_read32(counter) > apr_atomic_read32(&slot->dir.max_counter) ) {
+        update_max( &slot->dir.max_counter, leased_in_use( eng, conf_id, type ) );
+    }
+    return LEASE_USED(v) + 1;
+}
+
+/* give the lease back once idle, and trim it well above what is in use */
+static int release_leased( dirlimit_engine *eng, int conf_id, const char* type,
+    apr_uint32_t batch )
+{
+    dirlimit_slot *slot = &eng->slots[conf_id];
+    volatile uint64_t *lease = lease_of( eng, conf_id, type );
+    apr_uint32_t used, held, keep;
+    uint64_t v;
+
+    do {
+        v = *lease;
+        used = LEASE_USED(v);
+        held = LEASE_HELD(v);
+        if( used == 0 ) {
+            return -1;
+        }
+        used--;
+        keep = held;
+        if( used == 0 ) {
+            keep = 0;
+        } else if( held > used + batch * 2 ) {
+            keep = used + batch;
+        }
+    } while( ATOMIC_CAS64( lease, ((uint64_t)keep << 32) | used, v ) != v );
+    if( held > keep ) {
+        apr_atomic_sub32( (type == SCRIPT_TYPE) ? &slot->counter_script : &slot->counter,
+            held - keep );
+        apr_atomic_inc32(&slot->lease_return);
+    }
+    return 0;
+}
+
+/* child exit: hand back whatever is leased and not in use */
+static apr_status_t return_leases( void *data )
+{
+    dirlimit_engine *eng = data;
+    apr_uint32_t i, used, in_use = 0;
+    uint64_t v;
+
+    for( i=0; i<eng->shm->slots_num * 2; i++ ) {
+        /* units still in use go back with their release */
+        do {
+            v = eng->leases[i];
+            used = LEASE_USED(v);
+        } while( ATOMIC_CAS64( &eng->leases[i], ((uint64_t)used << 32) | used, v ) != v );
+        if( LEASE_HELD(v) > used ) {
+            apr_atomic_sub32( (i & 1) ? &eng->slots[i/2].counter_script : &eng->slots[i/2].counter,
+                LEASE_HELD(v) - used );
+        }
+        in_use += used;
+    }
+    /* else dirlimit_reap() takes the rest once the process is gone */
+    if( eng->proc >= 0 && in_use == 0 ) {
+        apr_atomic_set32(&eng->procs[eng->proc].pid, 0);
+    }
+    return APR_SUCCESS;
+}
+
+/*
+ * per child: leases go back when p is destroyed. They are kept in a row of
+ * the segment when one is free, so that a child that dies still gives them
+ * back through dirlimit_reap(); else in process memory.
+ */
+void dirlimit_engine_child_init( dirlimit_engine *eng, apr_pool_t *p )
+{
+    apr_uint32_t i;
+
+    eng->pid = (apr_uint32_t)getpid();
+    eng->proc = -1;
+    eng->leases = NULL;
+    for( i=0; i<eng->shm->procs_num; i++ ) {
+        if( eng->procs[i].pid == 0 && apr_atomic_cas32(&eng->procs[i].pid, eng->pid, 0) == 0 ) {
+            eng->proc = i;
+            eng->leases = lease_row( eng, i );
+            memset( (void*)eng->leases, 0, sizeof(uint64_t) * eng->shm->slots_num * 2 );
+            break;
+        }
+    }
+    if( eng->leases == NULL ) {
+        eng->leases = apr_pcalloc( p, sizeof(uint64_t) * eng->shm->slots_num * 2 );
+    }
+    apr_pool_cleanup_register( p, eng, return_leases, apr_pool_cleanup_null );
+}
+
+/*
+ * An owner entry for a request that takes at most handles_max counters.
+ * NULL if the table is full or was not set up; the request then goes
+ * untracked, as before.
+ */
+dirlimit_owner *dirlimit_owner_claim( dirlimit_engine *eng, int handles_max )
+{
+    apr_uint32_t i, n = eng->shm->owners_num, start;
+    dirlimit_owner *o;
+
+    if( n == 0 || eng->pid == 0 ) {
+        return NULL;
+    }
+    if( handles_max <= DIRLIMIT_OWNER_HANDLES ) {
+        start = apr_atomic_inc32(&eng->owner_next);
+        for( i=0; i<n; i++ ) {
+            o = &eng->owners[ (start + i) % n ];
+            if( o->pid == 0 && apr_atomic_cas32(&o->pid, eng->pid, 0) == 0 ) {
+                o->handles_num = 0;
+                o->waiting = 0;
+                return o;
+            }
+        }
+    }
+    ATOMIC_INC64(&eng->shm->n_ownerfull);
+    return NULL;
+}
+
+void dirlimit_owner_free( dirlimit_engine *eng, dirlimit_owner *owner )
+{
+    owner->handles_num = 0;
+    owner->waiting = 0;
+    apr_atomic_set32(&owner->pid, 0);
+}
+
+/*
+ * The record may have been shifted towards its home bucket by
+ * remove_record() since it was taken; the generation tells.
+ */
+static dirlimit_record *find_handle( dirlimit_engine *eng, const dirlimit_handle *h )
+{
+    dirlimit_record *rs = eng->records;
+    size_t mask = eng->shm->table_size - 1;
+    size_t i;
+
+    if( rs[h->pos].gen == h->gen && rs[h->pos].conf_id == h->conf_id ) {
+        return &rs[h->pos];
+    }
+    for( i = h->hash & mask; rs[i].conf_id >= 0; i = (i+1) & mask ) {
+        if( rs[i].gen == h->gen && rs[i].conf_id == h->conf_id ) {
+            return &rs[i];
+        }
+    }
+    return NULL;
+}
+
+/* global mutex must be held */
+static int release_client( dirlimit_engine *eng, const dirlimit_handle *h, const char* type )
+{
+    dirlimit_client *cs = eng->clients;
+    size_t mask = eng->shm->clients_table_size - 1;
+    size_t i;
+    dirlimit_client *c = NULL;
+
+    /* shifted by a removal since taken? the generation tells */
+    if( cs[h->pos].gen == h->gen && cs[h->pos].conf_id == h->conf_id ) {
+        c = &cs[h->pos];
+    } else {
+        for( i = h->hash & mask; cs[i].conf_id >= 0; i = (i+1) & mask ) {
+            if( cs[i].gen == h->gen && cs[i].conf_id == h->conf_id ) {
+                c = &cs[i];
+                break;
+            }
+        }
+    }
+    if( c == NULL ) {
+        return -1;
+    }
+    if( type == SCRIPT_TYPE ) {
+        (c->counter_script)--;
+    } else {
+        (c->counter)--;
+    }
+    if( c->counter == 0 && c->counter_script == 0 ) {
+        remove_client( eng, c - cs );
+    } else if( c->counter < 0 || c->counter_script < 0 ) {
+        return -1;
+    }
+    return 0;
+}
+
+/* global mutex must be held */
+static int release_record( dirlimit_engine *eng, const dirlimit_handle *h, const char* type,
+    int rollback )
+{
+    dirlimit_record *rec;
+
+    rec = find_handle( eng, h );
+    if( rec == NULL ) {
+        return -1;
+    }
+    if( rollback ) {
+        rec->accepted--;
+    }
+    if( type == SCRIPT_TYPE ) {
+        (rec->counter_script)--;
+    } else {
+        (rec->counter)--;
+        if( h->pool >= 0 ) {
+            (rec->reserved[h->pool])--;
+        }
+    }
+    if( record_idle( rec, (uint64_t)apr_time_now() * 1000 ) ) {
+        remove_record( eng, rec - eng->records );
+    } else if( rec->counter < 0 || rec->counter_script < 0 ) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Release handles in reverse order of acquisition.
+ * The global mutex must be held if any of them is a subdir or client entry.
+ * hold < 0 means a rollback, which is not recorded in the histograms.
+ * Returns the number of counters that were missing or already zero;
+ * the caller logs them after unlocking.
+ */
+static int release_handles( dirlimit_engine *eng, const dirlimit_handle *handles,
+    int n, const char *type, apr_interval_time_t hold )
+{
+    dirlimit_stat *st;
+    dirlimit_slot *slot;
+    int i, err = 0, b;
+
+    b = hist_bucket(hold);
+    for( i=n-1; i>=0; i-- ) {
+        st = stat_of( &eng->slots[ handles[i].conf_id ], handles[i].kind );
+        if( hold >= 0 ) {
+            apr_atomic_inc32(&st->hist[b]);
+            ATOMIC_ADD64(&st->hold_usec, (uint64_t)hold);
+        } else {
+            /* the request was not accepted after all */
+            apr_atomic_dec32(&st->accepted);
+            if( type == SCRIPT_TYPE ) {
+                apr_atomic_dec32(&st->accepted_script);
+            }
+        }
+        if( handles[i].kind == LEVEL_SUB ) {
+            err -= release_record( eng, &handles[i], type, hold < 0 );
+        } else if( handles[i].kind == LEVEL_CLIENT ) {
+            err -= release_client( eng, &handles[i], type );
+        } else {
+            if( handles[i].lease ) {
+                err -= release_leased( eng, handles[i].conf_id, type, handles[i].lease );
+            } else if( handles[i].pool >= -1 ) {
+                slot = &eng->slots[ handles[i].conf_id ];
+                err -= release_counter( handles[i].pool < 0 ?
+                    &slot->general : &slot->reserved[ handles[i].pool ] );
+                err -= release_counter( &slot->counter );
+            } else {
+                err -= release_slot( eng, handles[i].conf_id, type );
+            }
+            if( hold >= 0 && type != SCRIPT_TYPE &&
+                    eng->slots[ handles[i].conf_id ].adapt_max > 0 ) {
+                adapt_limit( &eng->slots[ handles[i].conf_id ], hold );
+            }
+        }
+    }
+    return err;
+}
+
+#ifdef __linux__
+static inline void wait_on( volatile apr_uint32_t *addr, apr_uint32_t val, apr_interval_time_t usec )
+{
+    struct timespec ts;
+    ts.tv_sec = usec / APR_USEC_PER_SEC;
+    ts.tv_nsec = (usec % APR_USEC_PER_SEC) * 1000;
+    /* shared futex, the word lives in shared memory */
+    syscall( SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0 );
+}
+
+static inline void wake_on( volatile apr_uint32_t *addr, int n )
+{
+    syscall( SYS_futex, addr, FUTEX_WAKE, n, NULL, NULL, 0 );
+}
+#else
+static inline void wait_on( volatile apr_uint32_t *addr, apr_uint32_t val, apr_interval_time_t usec )
+{
+    apr_sleep( usec < 1000 ? usec : 1000 );
+}
+
+static inline void wake_on( volatile apr_uint32_t *addr, int n )
+{
+}
+#endif
+
+/*
+ * dirlimit-admin: replace the configured limits of a config at runtime.
+ * limits[] is indexed by DIRLIMIT_OV_*; DIRLIMIT_KEEP leaves one as
+ * configured, and all of them DIRLIMIT_KEEP drops the override.
+ * Callers serialize through the global mutex.
+ */
+void dirlimit_set_override( dirlimit_engine *eng, int conf_id, const int *limits )
+{
+    dirlimit_slot *slot = &eng->slots[conf_id];
+    int i, any = 0;
+
+    for( i=0; i<DIRLIMIT_OVERRIDES; i++ ) {
+        slot->override[i] = limits[i];
+        if( limits[i] != DIRLIMIT_KEEP ) {
+            any = 1;
+        }
+    }
+    __sync_synchronize();
+    if( any && !slot->overridden ) {
+        apr_atomic_set32(&slot->overridden, 1);
+        apr_atomic_inc32(&eng->shm->overrides);
+    } else if( !any && slot->overridden ) {
+        apr_atomic_set32(&slot->overridden, 0);
+        apr_atomic_dec32(&eng->shm->overrides);
+    }
+    slot->override_time = (apr_uint32_t)apr_time_sec(apr_time_now());
+    /* a raised limit may let the queue in */
+    apr_atomic_inc32(&slot->wake_seq);
+    wake_on( &slot->wake_seq, INT_MAX );
+}
+
+static inline int override_of( dirlimit_engine *eng, int conf_id, int which, int limit )
+{
+    int v;
+    if( apr_atomic_read32(&eng->shm->overrides) == 0 ||
+            !apr_atomic_read32(&eng->slots[conf_id].overridden) ) {
+        return limit;
+    }
+    v = eng->slots[conf_id].override[which];
+    return v == DIRLIMIT_KEEP ? limit : v;
+}
+
+/* wake DirLimitWait waiters of the released counters; call without the mutex */
+static void wake_handles( dirlimit_engine *eng, const dirlimit_handle *handles, int n )
+{
+    dirlimit_slot *slot;
+    int i;
+    for( i=0; i<n; i++ ) {
+        slot = &eng->slots[ handles[i].conf_id ];
+        if( apr_atomic_read32(&slot->waiters) > 0 ) {
+            apr_atomic_inc32(&slot->wake_seq);
+            /* a freed subdir or client entry only suits some of the waiters */
+            wake_on( &slot->wake_seq, handles[i].kind == LEVEL_DIR ? 1 : INT_MAX );
+        }
+    }
+}
+
+int dirlimit_enter_queue( dirlimit_engine *eng, int conf_id, int max_queue )
+{
+    dirlimit_slot *slot = &eng->slots[conf_id];
+    apr_uint32_t c, m;
+
+    do {
+        c = apr_atomic_read32(&slot->waiters);
+        if( max_queue > 0 && c >= (apr_uint32_t)max_queue ) {
+            apr_atomic_inc32(&slot->wait_full);
+            return -1;
+        }
+    } while( apr_atomic_cas32(&slot->waiters, c+1, c) != c );
+    do {
+        m = apr_atomic_read32(&slot->wait_max_depth);
+    } while( m < c+1 && apr_atomic_cas32(&slot->wait_max_depth, c+1, m) != m );
+    apr_atomic_inc32(&slot->waited);
+    return 0;
+}
+
+void dirlimit_leave_queue( dirlimit_engine *eng, int conf_id )
+{
+    apr_atomic_dec32(&eng->slots[conf_id].waiters);
+}
+
+/* sleep until a release on the config bumps wake_seq past seq, or usec passes */
+void dirlimit_wait( dirlimit_engine *eng, int conf_id, apr_uint32_t seq,
+    apr_interval_time_t usec )
+{
+    wait_on( &eng->slots[conf_id].wake_seq, seq, usec );
+}
+
+/*
+ * GCRA admission of one request, lock-free on the virtual time in nsec.
+ * On rejection *wait is how long until the bucket conforms again.
+ */
+static int take_token( volatile uint64_t *tat, const dirlimit_gcra *g, uint64_t now, uint64_t *wait )
+{
+    uint64_t t, start;
+
+    do {
+        t = *tat;
+        start = t > now ? t : now;
+        if( start - now > g->tau ) {
+            *wait = start - now - g->tau;
+            return -1;
+        }
+    } while( ATOMIC_CAS64( tat, start + 1000000000 / g->rate, t ) != t );
+    return 0;
+}
+
+static inline void refund_token( volatile uint64_t *tat, const dirlimit_gcra *g )
+{
+    ATOMIC_SUB64( tat, 1000000000 / g->rate );
+}
+
+/*
+ * DirLimitRate and DirLimitRatePerSub, checked once every counter is
+ * taken so that a concurrency rejection costs no token. The global mutex
+ * is still held for the subdir records, so the handle positions are valid.
+ */
+static int take_rates( dirlimit_engine *eng, const dirlimit_chain *chain,
+    const dirlimit_reqconfig *rc, int *fail, int *fail_kind, uint64_t *wait )
+{
+    const dirlimit_level *lv;
+    uint64_t now = (uint64_t)apr_time_now() * 1000;
+    int i, j, n;
+
+    /* n follows the handles in the order dirlimit_acquire() took them */
+    for( i=0, n=0; i<chain->levels_num; i++ ) {
+        lv = &chain->levels[i];
+        if( lv->flags & LEVEL_DIR ) {
+            n++;
+        }
+        if( lv->rate.rate > 0 &&
+                take_token( &eng->slots[lv->conf_id].rate_tat, &lv->rate, now, wait ) < 0 ) {
+            *fail = i;
+            *fail_kind = LEVEL_DIR;
+            goto refund;
+        }
+        if( lv->flags & LEVEL_SUB ) {
+            if( lv->rate_sub.rate > 0 &&
+                    take_token( &eng->records[rc->handles[n].pos].rate_tat, &lv->rate_sub,
+                        now, wait ) < 0 ) {
+                *fail = i;
+                *fail_kind = LEVEL_SUB;
+                if( lv->rate.rate > 0 ) {
+                    refund_token( &eng->slots[lv->conf_id].rate_tat, &lv->rate );
+                }
+                goto refund;
+            }
+            n++;
+        }
+    }
+    return 0;
+
+refund:
+    for( j=0, n=0; j<i; j++ ) {
+        lv = &chain->levels[j];
+        if( lv->flags & LEVEL_DIR ) {
+            n++;
+        }
+        if( lv->rate.rate > 0 ) {
+            refund_token( &eng->slots[lv->conf_id].rate_tat, &lv->rate );
+        }
+        if( lv->flags & LEVEL_SUB ) {
+            if( lv->rate_sub.rate > 0 ) {
+                refund_token( &eng->records[rc->handles[n].pos].rate_tat, &lv->rate_sub );
+            }
+            n++;
+        }
+    }
+    return -1;
+}
+
+/* the owner entry follows once the handle is complete, see dirlimit_reap() */
+static inline void push_handle( dirlimit_reqconfig *rc )
+{
+    rc->handles_num++;
+    if( rc->owner ) {
+        rc->owner->handles_num = rc->handles_num;
+    }
+}
+
+/* before giving the counters back: a crash in between leaks rather than overshoots */
+static inline void drop_handles( const dirlimit_reqconfig *rc )
+{
+    if( rc->owner ) {
+        rc->owner->handles_num = 0;
+    }
+}
+
+/*
+ * Take every level of the chain, or nothing.
+ * On a rejection the failing level and LEVEL_* are stored in *fail and *fail_kind;
+ * *retry is set only if a request rate rejected it.
+ */
+int dirlimit_acquire( dirlimit_engine *eng, const dirlimit_chain *chain,
+    const dirlimit_key *keys, const char *type, int count,
+    dirlimit_reqconfig *rc, int *fail, int *fail_kind, apr_interval_time_t *retry )
+{
+    apr_status_t status = APR_SUCCESS;
+    const dirlimit_level *lv;
+    dirlimit_handle *h;
+    uint64_t wait;
+    int i, ret, limit, locked, lease, cls, pool;
+
+    rc->handles_num = 0;
+    *retry = 0;
+    /* the global mutex is only taken for the subdir and client tables */
+    locked = 0;
+    for( i=0; i<chain->levels_num; i++ ) {
+        lv = &chain->levels[i];
+        /* per-dir */
+        if( lv->flags & LEVEL_DIR ) {
+            limit = (type == SCRIPT_TYPE) ? lv->limit_script : lv->limit;
+            if( lv->adaptive && type != SCRIPT_TYPE ) {
+                limit = apr_atomic_read32(&eng->slots[lv->conf_id].limit_eff);
+            }
+            limit = override_of( eng, lv->conf_id,
+                (type == SCRIPT_TYPE) ? DIRLIMIT_OV_LIMIT_SCRIPT : DIRLIMIT_OV_LIMIT, limit );
+            lease = 0;
+            pool = -2;
+            cls = rc->classes ? rc->classes[i] : -1;
+            if( lv->reserve_total > 0 && limit >= 0 && type != SCRIPT_TYPE ) {
+                /* reserves need the shared counters, they take precedence over a lease */
+                ret = acquire_reserve( eng, lv, limit, cls, count, &pool );
+            } else if( lv->lease > 0 && limit >= lv->lease_min && eng->leases ) {
+                lease = lv->lease;
+                ret = acquire_leased( eng, lv->conf_id, limit, type, lease, count );
+            } else {
+                ret = acquire_slot( eng, lv->conf_id, limit, type, count );
+            }
+            if( lv->adaptive && type != SCRIPT_TYPE && ( ret < 0 || ret >= limit ) &&
+                    !eng->slots[lv->conf_id].adapt_full ) {
+                apr_atomic_set32(&eng->slots[lv->conf_id].adapt_full, 1);
+            }
+            if( ret < 0 ) {
+                *fail = i;
+                *fail_kind = LEVEL_DIR;
+                goto rejected;
+            }
+            h = &rc->handles[rc->handles_num];
+            h->conf_id = lv->conf_id;
+            h->kind = LEVEL_DIR;
+            h->lease = lease;
+            h->pool = pool;
+            push_handle( rc );
+        }
+        if( (lv->flags & (LEVEL_SUB | LEVEL_CLIENT)) && !locked ) {
+            /******* Lock *******/
+            status = dirlimit_lock( eng );
+            if( status != APR_SUCCESS ) {
+                ATOMIC_INC64(&eng->shm->n_lockerror);
+                /* only per-dir counters were taken so far */
+                drop_handles( rc );
+                release_handles( eng, rc->handles, rc->handles_num, type, -1 );
+                wake_handles( eng, rc->handles, rc->handles_num );
+                return DIRLIMIT_LOCKERROR;
+            }
+            locked = 1;
+        }
+        /* per-subdir */
+        if( lv->flags & LEVEL_SUB ) {
+            limit = (type == SCRIPT_TYPE) ? lv->limit_sub_script : lv->limit_sub;
+            limit = override_of( eng, lv->conf_id,
+                (type == SCRIPT_TYPE) ? DIRLIMIT_OV_SUB_SCRIPT : DIRLIMIT_OV_SUB, limit );
+            ret = check_limit( eng, &keys[i], lv, limit, rc->classes ? rc->classes[i] : -1,
+                type, count, &rc->handles[rc->handles_num] );
+            if( ret < 0 ) {
+                *fail = i;
+                *fail_kind = LEVEL_SUB;
+                goto rejected;
+            }
+            push_handle( rc );
+        }
+    }
+
+    /* after the others, so that their handles keep one per level flag */
+    for( i=0; i<chain->levels_num; i++ ) {
+        lv = &chain->levels[i];
+        if( lv->flags & LEVEL_CLIENT ) {
+            limit = (type == SCRIPT_TYPE) ? lv->limit_client_script : lv->limit_client;
+            ret = check_client( eng, lv->conf_id, rc->client_hash, limit, type, count,
+                &rc->handles[rc->handles_num] );
+            if( ret < 0 ) {
+                *fail = i;
+                *fail_kind = LEVEL_CLIENT;
+                goto rejected;
+            }
+            if( ret > 0 ) {
+                push_handle( rc );
+            }
+        }
+    }
+
+    if( chain->has_rate && take_rates( eng, chain, rc, fail, fail_kind, &wait ) < 0 ) {
+        count_rate_rejection( eng, chain->levels[*fail].conf_id, *fail_kind );
+        *retry = wait / 1000 + 1;
+        goto rejected;
+    }
+    
+    if( locked ) {
+        /******* Unlock *******/
+        status = dirlimit_unlock( eng );
+    }
+    if( rc->owner ) {
+        rc->owner->script = (type == SCRIPT_TYPE);
+        rc->owner->acquired = apr_time_now();
+    }
+    return DIRLIMIT_OK;
+
+rejected:
+    drop_handles( rc );
+    release_handles( eng, rc->handles, rc->handles_num, type, -1 );
+    if( locked ) {
+        status = dirlimit_unlock( eng );
+    }
+    wake_handles( eng, rc->handles, rc->handles_num );
+    return DIRLIMIT_REJECTED;
+}
+
+/*
+ * Without the mutex: the per-dir counters are atomics and go back now,
+ * the subdir and client entries stay in the owner entry for dirlimit_reap().
+ */
+static void release_unlocked( dirlimit_engine *eng, const dirlimit_reqconfig *rc,
+    apr_interval_time_t hold )
+{
+    int i, n;
+
+    drop_handles( rc );
+    for( i=rc->handles_num-1; i>=0; i-- ) {
+        if( rc->handles[i].kind == LEVEL_DIR ) {
+            release_handles( eng, &rc->handles[i], 1, rc->type, hold );
+            wake_handles( eng, &rc->handles[i], 1 );
+        }
+    }
+    if( rc->owner == NULL ) {
+        return;
+    }
+    for( i=0, n=0; i<rc->handles_num; i++ ) {
+        if( rc->handles[i].kind != LEVEL_DIR ) {
+            rc->handles[n++] = rc->handles[i];
+        }
+    }
+    rc->owner->handles_num = n;
+    apr_atomic_set32(&rc->owner->pid, DIRLIMIT_OWNER_ORPHAN);
+}
+
+/*
+ * Release every counter of the request and wake the waiters on them.
+ * Returns DIRLIMIT_LOCKERROR, or the number of counters that were
+ * missing or already zero. On DIRLIMIT_LOCKERROR the owner entry, if any,
+ * is left to dirlimit_reap().
+ */
+int dirlimit_release( dirlimit_engine *eng, const dirlimit_reqconfig *rc,
+    apr_interval_time_t hold )
+{
+    int err;
+
+    if( rc->need_lock && dirlimit_lock( eng ) != APR_SUCCESS ) {
+        ATOMIC_INC64(&eng->shm->n_lockerror);
+        release_unlocked( eng, rc, hold );
+        return DIRLIMIT_LOCKERROR;
+    }
+    drop_handles( rc );
+    err = release_handles( eng, rc->handles, rc->handles_num, rc->type, hold );
+    if( rc->need_lock ) {
+        dirlimit_unlock( eng );
+    }
+    wake_handles( eng, rc->handles, rc->handles_num );
+    return err;
+}
+
+/*
+ * Give back what dead children left: the counters of their requests in
+ * flight, their DirLimitWait places and their leases, and the entries
+ * dirlimit_release() could not give back for want of the mutex. alive()
+ * tells if a pid still runs. Called by the parent; returns the counters
+ * given back.
+ */
+int dirlimit_reap( dirlimit_engine *eng, int (*alive)( apr_uint32_t pid ) )
+{
+    dirlimit_handle hs[DIRLIMIT_OWNER_HANDLES];
+    dirlimit_owner *o;
+    dirlimit_slot *slot;
+    volatile uint64_t *leases;
+    apr_uint32_t i, pid, held;
+    int j, n, total = 0;
+
+    for( i=0; i<eng->shm->owners_num; i++ ) {
+        o = &eng->owners[i];
+        pid = apr_atomic_read32(&o->pid);
+        if( pid == 0 || (pid != DIRLIMIT_OWNER_ORPHAN && alive( pid )) ) {
+            continue;
+        }
+        /* leased units go back with the lease row below */
+        for( j=0, n=0; j<o->handles_num && j<DIRLIMIT_OWNER_HANDLES; j++ ) {
+            if( o->handles[j].kind != LEVEL_DIR || !o->handles[j].lease ) {
+                hs[n++] = o->handles[j];
+            }
+        }
+        if( n > 0 ) {
+            if( dirlimit_lock( eng ) != APR_SUCCESS ) {
+                ATOMIC_INC64(&eng->shm->n_lockerror);
+                break;
+            }
+            release_handles( eng, hs, n, o->script ? SCRIPT_TYPE : NO_SCRIPT_TYPE,
+                apr_time_now() - o->acquired );
+            dirlimit_unlock( eng );
+            wake_handles( eng, hs, n );
+            for( j=0; j<n; j++ ) {
+                apr_atomic_inc32(&eng->slots[ hs[j].conf_id ].reclaimed);
+            }
+            total += n;
+        }
+        if( o->waiting > 0 ) {
+            dirlimit_leave_queue( eng, o->waiting - 1 );
+        }
+        dirlimit_owner_free( eng, o );
+        ATOMIC_INC64(&eng->shm->n_reaped);
+    }
+
+    for( i=0; i<eng->shm->procs_num; i++ ) {
+        pid = apr_atomic_read32(&eng->procs[i].pid);
+        if( pid == 0 || alive( pid ) ) {
+            continue;
+        }
+        leases = lease_row( eng, i );
+        for( j=0; j<(int)eng->shm->slots_num * 2; j++ ) {
+            held = LEASE_HELD(leases[j]);
+            leases[j] = 0;
+            if( held == 0 ) {
+                continue;
+            }
+            slot = &eng->slots[j/2];
+            apr_atomic_sub32( (j & 1) ? &slot->counter_script : &slot->counter, held );
+            apr_atomic_add32( &slot->reclaimed_lease, held );
+            apr_atomic_inc32( &slot->wake_seq );
+            wake_on( &slot->wake_seq, INT_MAX );
+            total += held;
+        }
+        apr_atomic_set32(&eng->procs[i].pid, 0);
+        ATOMIC_INC64(&eng->shm->n_reaped);
+    }
+    ATOMIC_ADD64(&eng->shm->n_reclaimed, (uint64_t)total);
+    return total;
+}
+
+/*
+ * GCRA on a virtual time in nsec, reserved with a CAS so that every
+ * child can share the bucket without the global mutex.
+ * Returns how long to wait before sending len bytes.
+ */
+apr_interval_time_t dirlimit_charge( volatile uint64_t *tat, const dirlimit_gcra *bw,
+    uint64_t now, apr_off_t len )
+{
+    uint64_t t, start, cost;
+
+    cost = (uint64_t)len * 1000000000 / bw->rate;
+    do {
+        t = *tat;
+        start = t > now ? t : now;
+    } while( ATOMIC_CAS64( tat, start + cost, t ) != t );
+    if( start <= now + bw->tau ) {
+        return 0;
+    }
+    return (apr_interval_time_t)((start - now - bw->tau) / 1000);
+}
+
+/*
+ * The record is held by the request, but a removal elsewhere may have
+ * shifted it. Only then is the mutex taken to find it again; a charge
+ * racing with such a shift may be lost, which only makes it lenient.
+ */
+volatile uint64_t *dirlimit_record_bucket( dirlimit_engine *eng, dirlimit_handle *h,
+    const char *type )
+{
+    dirlimit_record *rec = &eng->records[h->pos];
+
+    if( rec->gen != h->gen || rec->conf_id != h->conf_id ) {
+        if( dirlimit_lock( eng ) != APR_SUCCESS ) {
+            ATOMIC_INC64(&eng->shm->n_lockerror);
+            return NULL;
+        }
+        rec = find_handle( eng, h );
+        if( rec ) {
+            h->pos = rec - eng->records;
+        }
+        dirlimit_unlock( eng );
+        if( rec == NULL ) {
+            return NULL;
+        }
+    }
+    return (type == SCRIPT_TYPE) ? &rec->bw_tat_script : &rec->bw_tat;
+}
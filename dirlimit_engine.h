@@ -0,0 +1,409 @@
+/*
+ * The limiter engine of mod_dirlimit: the shared memory layout, the
+ * counters and tables in it, and acquire/release over a limit chain.
+ * It depends on APR only, so that it can be driven without httpd
+ * (see dirlimit_bench.c).
+ */
+#ifndef DIRLIMIT_ENGINE_H
+#define DIRLIMIT_ENGINE_H
+
+#include "apr.h"
+#include "apr_general.h"
+#include "apr_pools.h"
+#include "apr_time.h"
+#include "apr_atomic.h"
+#include "apr_global_mutex.h"
+#include <stdint.h>
+
+#define CACHE_LINE 64
+#define DIRLIMIT_CLASSES 3          /* DirLimitReserve per scope */
+#define DIRLIMIT_NAME_BYTES 32      /* name arena per subdir record */
+#define DIRLIMIT_NAME_CLASSES 24    /* chunks of 16 << n bytes, see alloc_name() */
+#define DIRLIMIT_NO_NAME            0xffffffffU
+
+/* dirlimit_set_override() */
+#define DIRLIMIT_OV_LIMIT           0
+#define DIRLIMIT_OV_LIMIT_SCRIPT    1
+#define DIRLIMIT_OV_SUB             2
+#define DIRLIMIT_OV_SUB_SCRIPT      3
+#define DIRLIMIT_OVERRIDES          4
+#define DIRLIMIT_KEEP               -2  /* as configured */
+
+#define NO_SCRIPT_TYPE              ((const char*)1)
+#define SCRIPT_TYPE                 ((const char*)2)
+
+/* apr_atomic has no 64bit operations before APR 1.7 */
+#define ATOMIC_INC64(p) __sync_fetch_and_add((p), 1)
+#define ATOMIC_ADD64(p, v) __sync_fetch_and_add((p), (v))
+#define ATOMIC_SUB64(p, v) __sync_fetch_and_sub((p), (v))
+#define ATOMIC_CAS64(p, v, c) __sync_val_compare_and_swap((p), (c), (v))
+
+/* dirlimit_acquire() */
+#define DIRLIMIT_OK                 0
+#define DIRLIMIT_REJECTED           -1
+#define DIRLIMIT_LOCKERROR          -2
+
+typedef struct {
+    int conf_id;
+    int dirname_len;
+    uint64_t hash;              /* dirlimit_hash_record() */
+    const char *dirname;        /* need not be terminated */
+} dirlimit_key;
+
+/* fixed-size, cache-line aligned; the name is in the arena of the segment */
+typedef struct {
+    volatile uint64_t bw_tat;   /* DirLimitBandwidthPerSub, see dirlimit_charge() */
+    volatile uint64_t bw_tat_script;
+    volatile uint64_t rate_tat; /* DirLimitRatePerSub, see take_token() */
+    uint64_t hash;
+    int conf_id;                /* -1: empty slot */
+    apr_uint32_t gen;           /* unique per insertion, never 0 */
+    int counter;
+    int counter_script;
+    int reserved[DIRLIMIT_CLASSES]; /* part of counter, see take_reserve() */
+    apr_uint32_t accepted;
+    apr_uint32_t rejected;
+    apr_uint32_t rejected_reported;
+    apr_uint32_t max_counter;
+    apr_uint32_t name_off;      /* see dirlimit_record_name(), DIRLIMIT_NO_NAME: hash only */
+    apr_uint32_t name_len;
+    apr_uint32_t name_class;
+    char pad[CACHE_LINE - (sizeof(uint64_t)*4 + sizeof(int)*(11 + DIRLIMIT_CLASSES)) % CACHE_LINE];
+} dirlimit_record;
+
+/* DirLimitPerClient counter, keyed by conf_id and a hash of the address */
+typedef struct {
+    uint64_t hash;
+    int conf_id;                /* -1: empty slot */
+    apr_uint32_t gen;
+    int counter;
+    int counter_script;
+    apr_uint32_t pad[2];
+} dirlimit_client;
+
+/* hold time histogram: bucket 0 is < 1ms, bucket n is < 2^n ms */
+#define HIST_BUCKETS 16
+
+typedef struct {
+    volatile apr_uint32_t accepted;
+    volatile apr_uint32_t rejected;
+    volatile apr_uint32_t rate_rejected;
+    volatile apr_uint32_t accepted_script;      /* of accepted, SCRIPT_TYPE */
+    volatile apr_uint32_t rejected_script;
+    volatile apr_uint32_t max_counter;  /* concurrency high-watermark */
+    apr_uint32_t rejected_reported;     /* written by the parent only */
+    volatile apr_uint32_t hist[HIST_BUCKETS];
+    volatile uint64_t hold_usec;
+} dirlimit_stat;
+
+/* per-dir counters of a config, updated without the global mutex */
+typedef struct {
+    /* touched by every request */
+    volatile uint64_t bw_tat;           /* DirLimitBandwidth, see dirlimit_charge() */
+    volatile uint64_t bw_tat_script;
+    volatile uint64_t rate_tat;         /* DirLimitRate, see take_token() */
+    volatile apr_uint32_t counter;
+    volatile apr_uint32_t counter_script;
+    volatile apr_uint32_t waiters;      /* DirLimitWait queue depth */
+    volatile apr_uint32_t wake_seq;     /* futex word, bumped on release */
+    volatile apr_uint32_t limit_eff;    /* DirLimitAdaptive, see adapt_limit() */
+    volatile apr_uint32_t general;      /* DirLimitReserve, see acquire_reserve() */
+    volatile apr_uint32_t reserved[DIRLIMIT_CLASSES];
+    char pad1[CACHE_LINE - sizeof(apr_uint32_t)*(6 + DIRLIMIT_CLASSES) - sizeof(uint64_t)*3];
+    /* statistics */
+    volatile apr_uint32_t waited;
+    volatile apr_uint32_t wait_timeout;
+    volatile apr_uint32_t wait_full;
+    volatile apr_uint32_t wait_max_depth;
+    volatile uint64_t wait_usec;
+    volatile uint64_t bw_bytes;         /* bytes through the bandwidth filter */
+    volatile uint64_t bw_delay_usec;
+    volatile apr_uint32_t lease_refill; /* DirLimitLease batches taken */
+    volatile apr_uint32_t lease_return;
+    apr_uint32_t adapt_min;             /* DirLimitAdaptive, 0: off */
+    apr_uint32_t adapt_max;
+    volatile apr_uint32_t adapt_count;  /* releases in the current window */
+    volatile apr_uint32_t adapt_full;   /* the limit was hit in the window */
+    volatile apr_uint32_t adapt_up;
+    volatile apr_uint32_t adapt_down;
+    volatile uint64_t adapt_usec;
+    uint64_t adapt_base_usec;           /* baseline service time */
+    volatile uint64_t reserve_taken;    /* admitted beyond the general share */
+    uint64_t ident;                     /* scope owning the slot across restarts, 0: free */
+    volatile apr_uint32_t overridden;   /* dirlimit-admin, see dirlimit_set_override() */
+    volatile int override[DIRLIMIT_OVERRIDES];
+    apr_uint32_t override_time;         /* apr_time_sec() of the last change */
+    apr_uint32_t generation;            /* of the restart that gave the slot to ident */
+    apr_uint32_t claimed;               /* ident is in the running config */
+    volatile apr_uint32_t reclaimed;    /* counters of dead children, see dirlimit_reap() */
+    volatile apr_uint32_t reclaimed_lease;      /* leased units of dead children */
+    dirlimit_stat dir;
+    dirlimit_stat sub;          /* all subdir records of the config */
+    dirlimit_stat client;       /* all client entries of the config */
+    char pad2[CACHE_LINE - (sizeof(apr_uint32_t)*(18 + DIRLIMIT_OVERRIDES) + sizeof(uint64_t)*7
+        + sizeof(dirlimit_stat)*3) % CACHE_LINE];
+} dirlimit_slot;
+
+/*
+ * Head of the shared memory segment.
+ * It holds only offsets, so the segment can be attached at any address.
+ *
+ * External readers (see dirlimit_dump.c) attach it by DirLimitShmFile.
+ * The first six fields keep their place in every version: check magic
+ * and version, and that the sizes match the structs of this header,
+ * before looking further. Then the slots, the subdir record table and
+ * the client table follow at their offsets, each an array of the sizes
+ * given; the names of the records are NUL-terminated strings in the
+ * arena at names_offset. The tables and the arena change only under the
+ * global mutex, which bumps seq to odd on taking and back to even on
+ * releasing it; a copy made while seq was even and did not move is
+ * consistent without the mutex (see dirlimit_read_records()). Slot
+ * counters and the token bucket times are atomics of their own and are
+ * read one by one.
+ *
+ * The segment outlives graceful restarts. A slot belongs to the scope
+ * named by its ident and is handed to another one only once no request
+ * of an older generation holds a counter there (see dirlimit_conf_idle()).
+ */
+#define DIRLIMIT_SHM_MAGIC          0x4d494c44  /* "DLIM" on little endian */
+#define DIRLIMIT_SHM_VERSION        5
+
+typedef struct {
+    apr_uint32_t magic;
+    apr_uint32_t version;       /* bumped on any layout change */
+    apr_uint32_t header_size;
+    apr_uint32_t slot_size;
+    apr_uint32_t record_size;
+    apr_uint32_t client_size;
+    volatile apr_uint32_t seq;  /* odd while the tables are written */
+    volatile apr_uint32_t overrides;    /* slots with an override, 0: skip the check */
+    apr_uint32_t slots_num;
+    apr_uint32_t slots_offset;
+    apr_uint32_t table_size;    /* power of 2, >= records_size * 2 */
+    apr_uint32_t records_size;
+    apr_uint32_t records_offset;
+    apr_uint32_t records_num;
+    apr_uint32_t record_gen;
+    apr_uint32_t clients_table_size;    /* power of 2, >= clients_size * 2 */
+    apr_uint32_t clients_size;
+    apr_uint32_t clients_offset;
+    apr_uint32_t clients_num;
+    apr_uint32_t client_gen;
+    apr_uint32_t generation;    /* restarts the segment was kept through */
+    apr_uint32_t owners_num;    /* dirlimit_owner, one per request in flight */
+    apr_uint32_t owners_offset;
+    apr_uint32_t procs_num;     /* dirlimit_proc, one per child using DirLimitLease */
+    apr_uint32_t procs_offset;
+    apr_uint32_t leases_offset; /* procs_num rows of slots_num * 2 lease words */
+    apr_uint32_t names_top;     /* class of the whole arena */
+    apr_uint32_t names_size;    /* 16 << names_top, >= records_size * DIRLIMIT_NAME_BYTES */
+    apr_uint32_t names_offset;
+    apr_uint32_t names_map_offset;      /* a byte per 16, see alloc_name() */
+    apr_uint32_t names_free[DIRLIMIT_NAME_CLASSES];     /* DIRLIMIT_NO_NAME: empty */
+    volatile uint64_t n_total;
+    volatile uint64_t n_rejected;
+    volatile uint64_t n_ratelimited;    /* DirLimitRate, not in n_rejected */
+    volatile uint64_t n_lockerror;
+    volatile uint64_t n_tablefull;
+    volatile uint64_t n_clientfull;     /* admitted without a client entry */
+    volatile uint64_t n_ownerfull;      /* admitted without an owner entry */
+    volatile uint64_t n_reaped;         /* owner entries and rows of dead children */
+    volatile uint64_t n_reclaimed;      /* counters and leased units they held */
+    volatile uint64_t n_namefull;       /* records keeping the hash but no name */
+} dirlimit_shm_header;
+
+#define SHM_HEADER_SIZE APR_ALIGN(sizeof(dirlimit_shm_header), CACHE_LINE)
+
+/* time spent on the global mutex by one thread, in nsec */
+typedef struct {
+    uint64_t locks;
+    uint64_t wait_nsec;
+    uint64_t hold_nsec;
+    uint64_t locked_at;
+} dirlimit_lockstat;
+
+/* process-local view of the segment */
+typedef struct {
+    apr_global_mutex_t *mutex;
+    dirlimit_shm_header *shm;
+    dirlimit_slot *slots;
+    dirlimit_record *records;
+    dirlimit_client *clients;
+    char *names;
+    unsigned char *names_map;
+    struct dirlimit_owner *owners;
+    struct dirlimit_proc *procs;
+    volatile uint64_t *leases;  /* 2 per slot, see acquire_leased(); a row of the segment if proc >= 0 */
+    int proc;
+    apr_uint32_t pid;           /* 0: requests are not tracked */
+    volatile apr_uint32_t owner_next;   /* where dirlimit_owner_claim() starts looking */
+    dirlimit_lockstat *lockstat;        /* NULL: not measured */
+} dirlimit_engine;
+
+/* a counter taken by the request */
+typedef struct {
+    int conf_id;
+    int kind;                   /* LEVEL_DIR, LEVEL_SUB or LEVEL_CLIENT */
+    apr_uint32_t lease;         /* LEVEL_DIR: batch if taken from a lease */
+    int pool;                   /* DirLimitReserve class taken, -1: general */
+    size_t pos;
+    apr_uint32_t gen;
+    apr_uint32_t hash;
+} dirlimit_handle;
+
+/*
+ * The counters of a request in flight, in the segment, so that the parent
+ * can give them back if the child dies before releasing them. The handles
+ * are those of dirlimit_reqconfig, written in place by dirlimit_acquire().
+ */
+#define DIRLIMIT_OWNER_HANDLES      24
+#define DIRLIMIT_OWNER_ORPHAN       0xffffffffU /* pid: left by dirlimit_release() to the reaper */
+
+typedef struct dirlimit_owner {
+    volatile apr_uint32_t pid;          /* 0: free */
+    volatile int handles_num;
+    volatile int waiting;               /* DirLimitWait queue, conf_id + 1 */
+    int script;                         /* the request is SCRIPT_TYPE */
+    apr_time_t acquired;
+    dirlimit_handle handles[DIRLIMIT_OWNER_HANDLES];
+    char pad[CACHE_LINE - (sizeof(apr_uint32_t)*4 + sizeof(apr_time_t)
+        + sizeof(dirlimit_handle)*DIRLIMIT_OWNER_HANDLES) % CACHE_LINE];
+} dirlimit_owner;
+
+/* a child whose leases are in the segment */
+typedef struct dirlimit_proc {
+    volatile apr_uint32_t pid;          /* 0: free */
+    char pad[CACHE_LINE - sizeof(apr_uint32_t)];
+} dirlimit_proc;
+
+typedef struct {
+    const char *type;
+    int need_lock;              /* subdir or client table */
+    int released;
+    uint64_t client_hash;       /* DirLimitPerClient key */
+    const int *classes;         /* per level DirLimitReserve class, -1: none; NULL: all none */
+    dirlimit_owner *owner;      /* handles point into it; NULL: not tracked */
+    apr_time_t acquired;
+    int handles_num;
+    dirlimit_handle *handles;   /* levels_num * 3 */
+} dirlimit_reqconfig;
+
+#define LEVEL_DIR                   1
+#define LEVEL_SUB                   2
+#define LEVEL_CLIENT                4
+
+/* DirLimitBandwidth <bytes/s> [burst], DirLimitRate <req/s> [burst]; rate 0: not set */
+typedef struct {
+    apr_uint64_t rate;
+    apr_uint64_t burst;
+    apr_uint64_t tau;           /* burst in nsec */
+} dirlimit_gcra;
+
+/* one entry of the flattened limit chain */
+typedef struct {
+    int conf_id;
+    int flags;
+    int limit;
+    int limit_script;
+    int limit_sub;
+    int limit_sub_script;
+    int pathdepth;
+    int limit_client;
+    int limit_client_script;
+    int lease;
+    int lease_min;
+    int adaptive;               /* DirLimitAdaptive max, 0: off */
+    int reserve[DIRLIMIT_CLASSES];      /* DirLimitReserve, highest priority first */
+    int reserve_total;
+    dirlimit_gcra bw;
+    dirlimit_gcra bw_script;
+    dirlimit_gcra bw_sub;
+    dirlimit_gcra bw_sub_script;
+    dirlimit_gcra rate;
+    dirlimit_gcra rate_sub;
+} dirlimit_level;
+
+typedef struct {
+    const char *handler;
+    const char *type;
+} dirlimit_typemap;
+
+/* limits and script types of a merged config, nearest first */
+typedef struct {
+    dirlimit_level *levels;
+    int levels_num;
+    int need_lock;              /* some level uses the subdir or client table */
+    int has_bw;
+    int has_rate;
+    int has_client;
+    int has_reserve;
+    dirlimit_typemap *types;
+    int types_num;
+    int wait_ms;                /* nearest DirLimitWait */
+    int wait_queue;
+    int release;                /* nearest DirLimitRelease */
+} dirlimit_chain;
+
+/* names is the arena of the segment, or a copy by dirlimit_read_records(); NULL: hash only */
+static inline const char *dirlimit_record_name( const char *names, const dirlimit_record *rec )
+{
+    return rec->name_off == DIRLIMIT_NO_NAME ? NULL : names + rec->name_off;
+}
+
+static inline dirlimit_stat *stat_of( dirlimit_slot *slot, int kind )
+{
+    if( kind == LEVEL_CLIENT ) {
+        return &slot->client;
+    }
+    return kind == LEVEL_SUB ? &slot->sub : &slot->dir;
+}
+
+/* segment layout */
+apr_size_t dirlimit_engine_size( int slots_num, int records_size, int clients_size,
+    int procs_num, int owners_num );
+void dirlimit_engine_init( dirlimit_engine *eng, void *base,
+    int slots_num, int records_size, int clients_size, int procs_num, int owners_num );
+void dirlimit_engine_attach( dirlimit_engine *eng, void *base );
+void dirlimit_engine_child_init( dirlimit_engine *eng, apr_pool_t *p );
+
+apr_status_t dirlimit_lock( dirlimit_engine *eng );
+apr_status_t dirlimit_unlock( dirlimit_engine *eng );
+int dirlimit_check_layout( const dirlimit_shm_header *shm );
+int dirlimit_read_records( dirlimit_engine *eng, dirlimit_record *dst, int *pos, char *names,
+    int tries );
+
+uint64_t dirlimit_hash_record( int conf_id, const char *dirname, int len );
+uint64_t dirlimit_hash_client( const char *addr );
+uint64_t dirlimit_hash_ident( const char *ident );
+
+int dirlimit_acquire( dirlimit_engine *eng, const dirlimit_chain *chain,
+    const dirlimit_key *keys, const char *type, int count,
+    dirlimit_reqconfig *rc, int *fail, int *fail_kind, apr_interval_time_t *retry );
+int dirlimit_release( dirlimit_engine *eng, const dirlimit_reqconfig *rc,
+    apr_interval_time_t hold );
+void dirlimit_count_rejection( dirlimit_engine *eng, int conf_id, int kind,
+    const char *type );
+void dirlimit_set_adaptive( dirlimit_engine *eng, int conf_id, int min, int max );
+void dirlimit_set_override( dirlimit_engine *eng, int conf_id, const int *limits );
+int dirlimit_sweep( dirlimit_engine *eng, size_t *pos, size_t buckets );
+int dirlimit_conf_idle( dirlimit_engine *eng, int conf_id );
+void dirlimit_reset_conf( dirlimit_engine *eng, int conf_id );
+
+/* requests in flight and the reaper */
+dirlimit_owner *dirlimit_owner_claim( dirlimit_engine *eng, int handles_max );
+void dirlimit_owner_free( dirlimit_engine *eng, dirlimit_owner *owner );
+int dirlimit_reap( dirlimit_engine *eng, int (*alive)( apr_uint32_t pid ) );
+
+/* DirLimitWait */
+int dirlimit_enter_queue( dirlimit_engine *eng, int conf_id, int max_queue );
+void dirlimit_leave_queue( dirlimit_engine *eng, int conf_id );
+void dirlimit_wait( dirlimit_engine *eng, int conf_id, apr_uint32_t seq,
+    apr_interval_time_t usec );
+
+/* DirLimitBandwidth */
+apr_interval_time_t dirlimit_charge( volatile uint64_t *tat, const dirlimit_gcra *bw,
+    uint64_t now, apr_off_t len );
+volatile uint64_t *dirlimit_record_bucket( dirlimit_engine *eng, dirlimit_handle *h,
+    const char *type );
+
+#endif
@@ -0,0 +1,630 @@
+/*
+ * Replays an access log through the limiter engine to size DirLimit,
+ * DirLimitPerSub and DirLimitTableSize offline.
+ *
+ *   dirlimit_replay -c scopes.conf [-T table_size] [-w sec] [-n top] [-u] [access_log]
+ *
+ * The log needs %t and "%r" and ends with %D, e.g.
+ *   LogFormat "%h %l %u %t \"%r\" %>s %b %D" replay
+ * %t has a resolution of one second; with
+ *   [%{%d/%b/%Y:%H:%M:%S}t.%{usec_frac}t %{%z}t]
+ * in its place the requests start at the exact microsecond.
+ *
+ * Each line of the scope file is "<url-prefix> <DirLimit> [DirLimitPerSub]",
+ * -1 for no limit. A request is limited by the longest matching prefix and
+ * every shorter one above it, as nested <Location>s would be.
+ */
+#include "apr_general.h"
+#include "apr_getopt.h"
+#include "apr_hash.h"
+#include "apr_shm.h"
+#include "apr_strings.h"
+#include "dirlimit_engine.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#define LINE_MAX_LEN 65536
+
+typedef struct {
+    const char *prefix;
+    size_t len;
+    int limit;
+    int limit_sub;
+    dirlimit_chain chain;
+} replay_scope;
+
+/* a parsed request, pending by start time and then in flight by end time */
+typedef struct replay_req {
+    uint64_t key;
+    uint64_t start;
+    uint64_t dur;
+    int scope;
+    dirlimit_reqconfig rc;
+    dirlimit_key *keys;
+    char *names;                /* the dirnames of keys, terminated */
+    size_t names_size;
+    struct replay_req *next;    /* free list */
+} replay_req;
+
+typedef struct {
+    replay_req **v;
+    size_t n;
+    size_t size;
+} replay_heap;
+
+/* per subdir record; the engine drops its records once idle */
+typedef struct {
+    int conf_id;
+    uint64_t hash;
+    const char *dirname;
+    apr_uint32_t peak;
+    uint64_t requests;
+    uint64_t rejected;
+} replay_record;
+
+static replay_scope *scopes;
+static int scopes_num;
+static int max_levels;
+static dirlimit_engine engine;
+static apr_hash_t *records;
+static replay_req *free_reqs;
+static apr_pool_t *pool;
+
+static uint64_t n_lines, n_bad, n_nomatch, n_late, n_requests, n_rejected, n_tablefull;
+static apr_uint32_t peak_records;
+
+static void heap_push( replay_heap *h, replay_req *r )
+{
+    size_t i, j;
+
+    if( h->n == h->size ) {
+        h->size = h->size ? h->size * 2 : 1024;
+        h->v = realloc( h->v, sizeof(replay_req*) * h->size );
+    }
+    for( i = h->n++; i > 0; i = j ) {
+        j = (i - 1) / 2;
+        if( h->v[j]->key <= r->key ) {
+            break;
+        }
+        h->v[i] = h->v[j];
+    }
+    h->v[i] = r;
+}
+
+static replay_req *heap_pop( replay_heap *h )
+{
+    replay_req *top = h->v[0], *last = h->v[--h->n];
+    size_t i, c;
+
+    for( i = 0; (c = i * 2 + 1) < h->n; i = c ) {
+        if( c + 1 < h->n && h->v[c+1]->key < h->v[c]->key ) {
+            c++;
+        }
+        if( last->key <= h->v[c]->key ) {
+            break;
+        }
+        h->v[i] = h->v[c];
+    }
+    h->v[i] = last;
+    return top;
+}
+
+static replay_req *alloc_req( void )
+{
+    replay_req *r = free_reqs;
+
+    if( r ) {
+        free_reqs = r->next;
+        return r;
+    }
+    r = apr_pcalloc( pool, sizeof(*r) );
+    r->keys = apr_palloc( pool, sizeof(dirlimit_key) * max_levels );
+    r->rc.handles = apr_palloc( pool, sizeof(dirlimit_handle) * max_levels * 3 );
+    return r;
+}
+
+static inline void free_req( replay_req *r )
+{
+    r->next = free_reqs;
+    free_reqs = r;
+}
+
+/* as get_pathdepth() of the module */
+static int path_depth( const char *path )
+{
+    int i, l, c = 0;
+
+    if( *path == '/' ) {
+        path++;
+    }
+    l = strlen(path) - 1;
+    if( l > 0 ) {
+        c++;
+    }
+    for( i=0; i<l; i++ ) {
+        if( path[i] == '/' ) {
+            c++;
+        }
+    }
+    return c;
+}
+
+/* as get_dirname() of the module, in place; *n is its length */
+static const char *path_dirname( const char *path, size_t len, int depth, int *n )
+{
+    static const char unknown[] = "!!nuknown dir!!";
+    const char *p = path, *end = path + len;
+    int i;
+
+    if( p < end && *p == '/' ) {
+        p++;
+    }
+    for( i=0; i<depth; p++ ) {
+        if( p >= end ) {
+            *n = sizeof(unknown) - 1;
+            return unknown;
+        }
+        if( *p == '/' ) {
+            i++;
+        }
+    }
+    for( i = 0; p + i < end && p[i] != '/'; i++ ) {
+    }
+    *n = i;
+    return p;
+}
+
+static int prefix_match( const replay_scope *sc, const char *path, size_t len )
+{
+    if( len < sc->len || memcmp( path, sc->prefix, sc->len ) != 0 ) {
+        return 0;
+    }
+    return len == sc->len || sc->prefix[sc->len-1] == '/' || path[sc->len] == '/';
+}
+
+static const char *load_scopes( const char *fname, int unlimited )
+{
+    FILE *fp;
+    char line[1024], prefix[1024];
+    replay_scope *sc;
+    dirlimit_level *lv;
+    int i, j, n, limit, limit_sub, size = 0;
+
+    fp = fopen( fname, "r" );
+    if( fp == NULL ) {
+        return apr_psprintf( pool, "cannot open %s", fname );
+    }
+    while( fgets( line, sizeof(line), fp ) ) {
+        if( line[0] == '#' || line[0] == '\n' ) {
+            continue;
+        }
+        limit_sub = -1;
+        n = sscanf( line, "%1023s %d %d", prefix, &limit, &limit_sub );
+        if( n < 2 ) {
+            fclose( fp );
+            return apr_psprintf( pool, "bad scope line: %s", line );
+        }
+        /* hosting trees have a prefix per user, hundreds of them */
+        if( scopes_num == size ) {
+            size = size ? size * 2 : 64;
+            scopes = realloc( scopes, sizeof(replay_scope) * size );
+        }
+        sc = &scopes[scopes_num++];
+        memset( sc, 0, sizeof(*sc) );
+        sc->prefix = apr_pstrdup( pool, prefix );
+        sc->len = strlen( prefix );
+        sc->limit = limit;
+        sc->limit_sub = limit_sub;
+    }
+    fclose( fp );
+    if( scopes_num == 0 ) {
+        return "no scopes";
+    }
+
+    /* the chain of a scope: itself and every enclosing scope, nearest first */
+    for( i=0; i<scopes_num; i++ ) {
+        sc = &scopes[i];
+        for( j=0, n=0; j<scopes_num; j++ ) {
+            n += prefix_match( &scopes[j], sc->prefix, sc->len );
+        }
+        sc->chain.levels = apr_pcalloc( pool, sizeof(dirlimit_level) * n );
+        for( n = sc->len; n >= 0; n-- ) {
+            for( j=0; j<scopes_num; j++ ) {
+                if( scopes[j].len != (size_t)n || !prefix_match( &scopes[j], sc->prefix, sc->len ) ) {
+                    continue;
+                }
+                lv = &sc->chain.levels[sc->chain.levels_num++];
+                lv->conf_id = j;
+                lv->limit = scopes[j].limit;
+                lv->limit_script = -1;
+                lv->limit_sub = scopes[j].limit_sub;
+                if( unlimited ) {
+                    /* keep the levels, so that the peaks are still recorded */
+                    lv->limit = lv->limit >= 0 ? INT_MAX : -1;
+                    lv->limit_sub = lv->limit_sub >= 0 ? INT_MAX : -1;
+                }
+                lv->limit_sub_script = -1;
+                lv->limit_client = -1;
+                lv->limit_client_script = -1;
+                lv->pathdepth = path_depth( scopes[j].prefix );
+                if( scopes[j].limit >= 0 ) {
+                    lv->flags |= LEVEL_DIR;
+                }
+                if( scopes[j].limit_sub >= 0 ) {
+                    lv->flags |= LEVEL_SUB;
+                    sc->chain.need_lock = 1;
+                }
+            }
+        }
+        if( sc->chain.levels_num > max_levels ) {
+            max_levels = sc->chain.levels_num;
+        }
+    }
+    return NULL;
+}
+
+static int match_scope( const char *path, size_t len )
+{
+    int i, best = -1;
+
+    for( i=0; i<scopes_num; i++ ) {
+        if( prefix_match( &scopes[i], path, len ) &&
+                ( best < 0 || scopes[i].len > scopes[best].len ) ) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+static int64_t days_from_civil( int y, int m, int d )
+{
+    int era, yoe, doy, doe;
+
+    y -= m <= 2;
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = y - era * 400;
+    doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return (int64_t)era * 146097 + doe - 719468;
+}
+
+static inline int digits( const char *p, int n )
+{
+    int v = 0;
+    while( n-- > 0 ) {
+        if( *p < '0' || *p > '9' ) {
+            return -1;
+        }
+        v = v * 10 + (*p++ - '0');
+    }
+    return v;
+}
+
+/* "[10/Oct/2000:13:55:36[.frac] -0700]" to usec since the epoch, 0 on error */
+static uint64_t parse_time( const char *p )
+{
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    static char last[21];
+    static uint64_t last_sec;
+    const char *m;
+    uint64_t sec, usec = 0;
+    int tz, scale;
+
+    if( memcmp( p, last, 21 ) != 0 ) {
+        for( m = months; *m && memcmp( m, p + 4, 3 ) != 0; m += 3 ) {
+        }
+        if( *m == '\0' || digits( p + 1, 2 ) < 0 || digits( p + 8, 4 ) < 0 ||
+                digits( p + 13, 2 ) < 0 || digits( p + 16, 2 ) < 0 || digits( p + 19, 2 ) < 0 ) {
+            return 0;
+        }
+        last_sec = days_from_civil( digits( p + 8, 4 ), (m - months) / 3 + 1, digits( p + 1, 2 ) )
+            * 86400 + digits( p + 13, 2 ) * 3600 + digits( p + 16, 2 ) * 60 + digits( p + 19, 2 );
+        memcpy( last, p, 21 );
+    }
+    sec = last_sec;
+    p += 21;
+    if( *p == '.' ) {
+        for( p++, scale = 100000; *p >= '0' && *p <= '9'; p++, scale /= 10 ) {
+            usec += (*p - '0') * scale;
+        }
+    }
+    if( *p == ' ' ) {
+        p++;
+    }
+    if( (*p == '+' || *p == '-') && (tz = digits( p + 1, 4 )) >= 0 ) {
+        tz = (tz / 100) * 3600 + (tz % 100) * 60;
+        sec += *p == '+' ? -tz : tz;
+    }
+    return sec * 1000000 + usec;
+}
+
+/* %t, the path of "%r" and %D */
+static replay_req *parse_line( char *line )
+{
+    replay_req *r;
+    const replay_scope *sc;
+    const dirlimit_level *lv;
+    char *t, *q, *path, *end;
+    const char *name;
+    size_t len, off;
+    uint64_t start, dur;
+    int s, i, n;
+
+    t = strchr( line, '[' );
+    q = t ? strchr( t, '"' ) : NULL;
+    if( q == NULL || (start = parse_time( t )) == 0 ) {
+        return NULL;
+    }
+    path = strchr( q, ' ' );
+    if( path == NULL ) {
+        return NULL;
+    }
+    path++;
+    for( len = 0; path[len] && path[len] != ' ' && path[len] != '?' && path[len] != '"'; len++ ) {
+    }
+
+    end = line + strlen( line );
+    while( end > line && (end[-1] == '\n' || end[-1] == '\r' || end[-1] == ' ') ) {
+        end--;
+    }
+    for( dur = 0, t = end; t > line && t[-1] >= '0' && t[-1] <= '9'; t-- ) {
+    }
+    if( t == end || t[-1] != ' ' ) {
+        return NULL;
+    }
+    for( ; t < end; t++ ) {
+        dur = dur * 10 + (*t - '0');
+    }
+
+    s = match_scope( path, len );
+    if( s < 0 ) {
+        n_nomatch++;
+        return NULL;
+    }
+    sc = &scopes[s];
+    r = alloc_req();
+    r->start = r->key = start;
+    r->dur = dur;
+    r->scope = s;
+    /* a name is at most the path or the unknown one */
+    if( r->names_size < (len + 16) * max_levels ) {
+        r->names_size = (len + 16) * max_levels;
+        r->names = apr_palloc( pool, r->names_size );
+    }
+    off = 0;
+    for( i=0; i<sc->chain.levels_num; i++ ) {
+        lv = &sc->chain.levels[i];
+        if( lv->flags & LEVEL_SUB ) {
+            name = path_dirname( path, len, lv->pathdepth, &n );
+            memcpy( r->names + off, name, n );
+            r->names[off + n] = '\0';
+            r->keys[i].conf_id = lv->conf_id;
+            r->keys[i].dirname = r->names + off;
+            r->keys[i].dirname_len = n;
+            r->keys[i].hash = dirlimit_hash_record( lv->conf_id, r->names + off, n );
+            off += n + 1;
+        }
+    }
+    return r;
+}
+
+/* by the 64bit hash of conf_id and dirname, collisions are ignored */
+static replay_record *get_record( const dirlimit_key *key )
+{
+    replay_record *rec;
+
+    rec = apr_hash_get( records, &key->hash, sizeof(key->hash) );
+    if( rec == NULL ) {
+        rec = apr_pcalloc( pool, sizeof(*rec) );
+        rec->conf_id = key->conf_id;
+        rec->hash = key->hash;
+        rec->dirname = apr_pstrmemdup( pool, key->dirname, key->dirname_len );
+        apr_hash_set( records, &rec->hash, sizeof(rec->hash), rec );
+    }
+    return rec;
+}
+
+static void release_until( replay_heap *inflight, uint64_t now )
+{
+    replay_req *r;
+
+    while( inflight->n > 0 && inflight->v[0]->key <= now ) {
+        r = heap_pop( inflight );
+        dirlimit_release( &engine, &r->rc, r->dur );
+        free_req( r );
+    }
+}
+
+static void simulate( replay_heap *inflight, replay_req *r, uint64_t *clock )
+{
+    const dirlimit_chain *chain = &scopes[r->scope].chain;
+    const dirlimit_handle *h;
+    replay_record *rec;
+    apr_interval_time_t retry;
+    uint64_t tablefull;
+    int i, ret, fail, fail_kind;
+
+    if( r->start < *clock ) {
+        /* longer than the reorder window */
+        n_late++;
+    } else {
+        *clock = r->start;
+    }
+    release_until( inflight, r->start );
+
+    n_requests++;
+    r->rc.need_lock = chain->need_lock;
+    tablefull = engine.shm->n_tablefull;
+    ret = dirlimit_acquire( &engine, chain, r->keys, NULL, 1, &r->rc, &fail, &fail_kind, &retry );
+    if( ret != DIRLIMIT_OK ) {
+        n_rejected++;
+        if( engine.shm->n_tablefull != tablefull ) {
+            n_tablefull++;
+        } else if( fail_kind == LEVEL_SUB ) {
+            get_record( &r->keys[fail] )->rejected++;
+        }
+        free_req( r );
+        return;
+    }
+    if( engine.shm->records_num > peak_records ) {
+        peak_records = engine.shm->records_num;
+    }
+    /* handles follow the levels: one per LEVEL_DIR, then one per LEVEL_SUB */
+    for( i=0, ret=0; i<chain->levels_num; i++ ) {
+        if( chain->levels[i].flags & LEVEL_DIR ) {
+            ret++;
+        }
+        if( chain->levels[i].flags & LEVEL_SUB ) {
+            h = &r->rc.handles[ret++];
+            rec = get_record( &r->keys[i] );
+            rec->requests++;
+            if( (apr_uint32_t)engine.records[h->pos].counter > rec->peak ) {
+                rec->peak = engine.records[h->pos].counter;
+            }
+        }
+    }
+    r->key = r->start + r->dur;
+    heap_push( inflight, r );
+}
+
+static int cmp_peak( const void *a, const void *b )
+{
+    const replay_record *x = *(replay_record* const*)a, *y = *(replay_record* const*)b;
+    if( x->peak != y->peak ) {
+        return x->peak < y->peak ? 1 : -1;
+    }
+    return x->requests < y->requests ? 1 : x->requests > y->requests ? -1 : 0;
+}
+
+static void report( int top )
+{
+    apr_hash_index_t *hi;
+    replay_record **recs;
+    const dirlimit_slot *slot;
+    void *val;
+    int i, n;
+
+    printf( "lines: %" APR_UINT64_T_FMT " unparsed: %" APR_UINT64_T_FMT
+        " unmatched: %" APR_UINT64_T_FMT " late: %" APR_UINT64_T_FMT "\n",
+        n_lines, n_bad, n_nomatch, n_late );
+    printf( "requests: %" APR_UINT64_T_FMT " rejected: %" APR_UINT64_T_FMT " (%.2f%%)"
+        " tablefull: %" APR_UINT64_T_FMT "\n",
+        n_requests, n_rejected, n_requests ? 100.0 * n_rejected / n_requests : 0.0, n_tablefull );
+    printf( "peak live records: %u (DirLimitTableSize %u)\n",
+        peak_records, (unsigned)engine.shm->records_size );
+
+    printf( "\nscopes:\n cid| lim| peak|  reject|persub| peak|  reject|%15s\n", "prefix" );
+    for( i=0; i<scopes_num; i++ ) {
+        slot = &engine.slots[i];
+        printf( "%4d|%4d|%5u|%8u|%6d|%5u|%8u|%15s\n",
+            i, scopes[i].limit, slot->dir.max_counter, slot->dir.rejected,
+            scopes[i].limit_sub, slot->sub.max_counter, slot->sub.rejected, scopes[i].prefix );
+    }
+
+    n = apr_hash_count( records );
+    recs = apr_palloc( pool, sizeof(replay_record*) * (n > 0 ? n : 1) );
+    for( i = 0, hi = apr_hash_first( pool, records ); hi; hi = apr_hash_next( hi ) ) {
+        apr_hash_this( hi, NULL, NULL, &val );
+        recs[i++] = val;
+    }
+    qsort( recs, n, sizeof(replay_record*), cmp_peak );
+    printf( "\nsubdir records: %d, top %d by peak\n"
+        " cid| peak| requests|  reject|%15s dirname\n", n, top < n ? top : n, "prefix" );
+    for( i=0; i<n && i<top; i++ ) {
+        printf( "%4d|%5u|%9" APR_UINT64_T_FMT "|%8" APR_UINT64_T_FMT "|%15s %s\n",
+            recs[i]->conf_id, recs[i]->peak, recs[i]->requests, recs[i]->rejected,
+            scopes[ recs[i]->conf_id ].prefix, recs[i]->dirname );
+    }
+}
+
+static void usage( void )
+{
+    fprintf( stderr, "usage: dirlimit_replay -c scopes [-T DirLimitTableSize] [-w reorder sec]"
+        " [-n top records] [-u] [access_log]\n"
+        "  -u: ignore the limits, report the peaks they would have to allow\n" );
+    exit(2);
+}
+
+int main( int argc, const char * const argv[] )
+{
+    apr_getopt_t *opt;
+    apr_shm_t *shm;
+    replay_heap pending = { NULL, 0, 0 }, inflight = { NULL, 0, 0 };
+    replay_req *r;
+    const char *arg, *scope_file = NULL, *err;
+    char c, *line;
+    FILE *fp;
+    uint64_t latest = 0, clock = 0, window = 30 * 1000000ULL;
+    int table_size = 128, top = 20, unlimited = 0;
+
+    apr_initialize();
+    atexit( apr_terminate );
+    apr_pool_create( &pool, NULL );
+
+    apr_getopt_init( &opt, pool, argc, argv );
+    while( apr_getopt( opt, "c:T:w:n:u", &c, &arg ) == APR_SUCCESS ) {
+        switch( c ) {
+        case 'c': scope_file = arg; break;
+        case 'T': table_size = atoi(arg); break;
+        case 'w': window = (uint64_t)atoi(arg) * 1000000; break;
+        case 'n': top = atoi(arg); break;
+        case 'u': unlimited = 1; break;
+        default: usage();
+        }
+    }
+    if( scope_file == NULL || table_size < 16 ) {
+        usage();
+    }
+    if( (err = load_scopes( scope_file, unlimited )) != NULL ) {
+        fprintf( stderr, "dirlimit_replay: %s\n", err );
+        return 1;
+    }
+
+    if( apr_global_mutex_create( &engine.mutex, NULL, APR_LOCK_DEFAULT, pool ) != APR_SUCCESS ||
+            apr_shm_create( &shm, dirlimit_engine_size( scopes_num, table_size, 16, 0, 0 ),
+                NULL, pool ) != APR_SUCCESS ) {
+        fprintf( stderr, "dirlimit_replay: cannot set up the engine\n" );
+        return 1;
+    }
+    dirlimit_engine_init( &engine, apr_shm_baseaddr_get(shm), scopes_num, table_size, 16,
+        0, 0 );
+    records = apr_hash_make( pool );
+
+    fp = stdin;
+    if( opt->ind < argc && (fp = fopen( argv[opt->ind], "r" )) == NULL ) {
+        fprintf( stderr, "dirlimit_replay: cannot open %s\n", argv[opt->ind] );
+        return 1;
+    }
+    setvbuf( fp, NULL, _IOFBF, 1 << 20 );
+    line = malloc( LINE_MAX_LEN );
+
+    /*
+     * The log is in order of completion; requests are held back for the
+     * reorder window and fed to the engine in order of start.
+     */
+    while( fgets( line, LINE_MAX_LEN, fp ) ) {
+        n_lines++;
+        r = parse_line( line );
+        if( r == NULL ) {
+            n_bad++;
+            continue;
+        }
+        heap_push( &pending, r );
+        if( r->start > latest ) {
+            latest = r->start;
+        }
+        while( pending.n > 0 && pending.v[0]->key + window <= latest ) {
+            simulate( &inflight, heap_pop( &pending ), &clock );
+        }
+    }
+    while( pending.n > 0 ) {
+        simulate( &inflight, heap_pop( &pending ), &clock );
+    }
+    release_until( &inflight, UINT64_MAX );
+    n_bad -= n_nomatch;
+
+    report( top );
+    return 0;
+}
@@ -2,13 +2,24 @@
 #include "http_config.h"
 #include "http_protocol.h"
 #include "http_log.h"
+#include "http_main.h"
 #include "http_request.h"
 #include "ap_config.h"
+#include "ap_mpm.h"
 #include "apr_hooks.h"
 #include "apr_strings.h"
+#include "apr_lib.h"
 #include "apr_global_mutex.h"
+#include "apr_thread_mutex.h"
 #include "apr_tables.h"
+#include "apr_atomic.h"
+#include "apr_network_io.h"
 #include "unixd.h"
+#include "mpm_common.h"
+#include "dirlimit_engine.h"
+#include <signal.h>
+#include <errno.h>
+#include <limits.h>
 
 #ifdef AP_DECLARE_MODULE
 #define APACHE24
@@ -18,14 +29,9 @@
 #define unixd_set_global_mutex_perms ap_unixd_set_global_mutex_perms
 #endif
 
-#define MAX_DIRNAME 64
-#define MAX_CONFIGS 128
-
 #define USER_DATA_KEY "mod_dirlimit_key"
-#define DIRLIMIT_ORIGPATH "mod_dirlimit_origpath"
-#define DIRLIMIT_ORIGTYPE "mod_dirlimit_origtype"
+#define PERSIST_KEY "mod_dirlimit_persist"
 #define MUTEX_PATH NULL
-#define SHM_PATH NULL
 
 //#define DEBUGLOG(...) ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_NOTICE, 0, NULL, __VA_ARGS__)
 #define DEBUGLOG(...)
@@ -39,31 +45,49 @@
 #define CONTEXT_LOCATION_MATCH      6
 #define CONTEXT_OTHERS              7
 
-#define NO_SCRIPT_TYPE              ((const char*)1)
-#define SCRIPT_TYPE                 ((const char*)2)
-
 extern module AP_MODULE_DECLARE_DATA dirlimit_module;
 
-typedef struct {
-    int conf_id;
-    char *dirname;
-    int counter;
-    int counter_script;
-} dirlimit_record;
-
 typedef struct {
     int allow_override;
-    apr_global_mutex_t *mutex;
     apr_shm_t *shm_data;
-    char *strdata;
-    dirlimit_record *records;
+    const char *shm_file;       /* DirLimitShmFile, NULL: anonymous */
+    dirlimit_engine eng;
     size_t records_size;
-    size_t *records_num;
-    uint64_t *n_total;
-    uint64_t *n_rejected;
-    uint64_t *n_lockerror;
+    size_t clients_size;
+    int log_interval;           /* seconds, 0: no rejection summary */
+    apr_time_t last_report;     /* parent only */
+    uint64_t tablefull_reported;
+    size_t sweep_pos;           /* parent only, next bucket for dirlimit_monitor() */
 } dirlimit_sconfig;
 
+/* DirLimitRelease */
+#define RELEASE_UNSET               0
+#define RELEASE_LOG                 1
+#define RELEASE_HANDLER             2
+#define RELEASE_EOS                 3
+
+#define RELEASE_HANDLER_FILTER      "DIRLIMIT_RELEASE_HANDLER"
+#define RELEASE_EOS_FILTER          "DIRLIMIT_RELEASE_EOS"
+#define BANDWIDTH_FILTER            "DIRLIMIT_BANDWIDTH"
+
+/* bytes sent per sleep, about 100ms worth of the slowest bucket */
+#define BW_CHUNK_MIN                1024
+#define BW_CHUNK_MAX                65536
+
+/* DirLimitReserve <class> <num> */
+#define CLASS_METHOD                1
+#define CLASS_ENV                   2
+#define CLASS_NET                   3
+
+typedef struct {
+    const char *name;           /* as configured, for the status */
+    int kind;
+    apr_int64_t methods;        /* AP_METHOD_BIT << method_number */
+    const char *env;
+    apr_ipsubnet_t *net;
+    int num;
+} dirlimit_class;
+
 typedef struct dirlimit_dirconfig {
     int limit;
     int limit_script;
@@ -74,506 +98,1942 @@ typedef struct dirlimit_dirconfig {
     int cmd_context;
     int sub;
     int pathdepth;
-    int conf_id;
+    int conf_id;                /* -1: no DirLimit directive in the scope */
+    uint64_t ident;
+    int wait_ms;                /* -1: not set */
+    int wait_queue;             /* 0: unbounded */
+    int release;
+    int limit_client;
+    int limit_client_script;
+    int lease;                  /* DirLimitLease batch, 0: not set */
+    int lease_min;
+    int adaptive_min;           /* DirLimitAdaptive, 0: not set */
+    int adaptive_max;
+    int reserves_num;
+    dirlimit_class reserves[DIRLIMIT_CLASSES];
+    dirlimit_gcra bw;
+    dirlimit_gcra bw_script;
+    dirlimit_gcra bw_sub;
+    dirlimit_gcra bw_sub_script;
+    dirlimit_gcra rate;
+    dirlimit_gcra rate_sub;
     struct dirlimit_dirconfig *parent;
+    const struct dirlimit_dirconfig *origin;    /* as created, merged copies keep it */
+    int transient;              /* .htaccess, created per request */
+    struct dirlimit_cached_chain *volatile chains;      /* of the origin, see get_chain() */
 } dirlimit_dirconfig;
 
+/* a compiled chain, keyed by the origins of its levels */
+#define CHAIN_DEPTH_MAX 32
+
+typedef struct dirlimit_cached_chain {
+    struct dirlimit_cached_chain *next;
+    int depth;
+    const dirlimit_dirconfig **origins;         /* nearest first */
+    dirlimit_chain *chain;
+} dirlimit_cached_chain;
+
 static int post_config_flag = 0;
-static int conf_counter = 0;
-static dirlimit_dirconfig conf_list[MAX_CONFIGS];
-
-int binsearch(
-    const void *key,
-    const void *base,
-    size_t nmemb,
-    size_t size,
-    size_t *pos,
-    int (*compare)(const void *, const void *) )
-{
-    int lower, upper, middle;
-    int ret;
-    char *p;
-    lower = 0;
-    upper = nmemb-1;
-    
-    while( lower <= upper ) {
-        middle = (lower + upper) / 2;
-        p = (char*)base + size * middle;
-        ret = compare( key, (void*)p );
-        if( middle >= nmemb ) {
-            DEBUGLOG("middle %d >= nmemb %d", (int)middle, (int)nmemb);
-        }
-        if( ret == 0 ) { /* key == base[middle] */
-            *pos = middle;
-            return 1;
-        } else if( ret > 0 ) { /* key > base[middle] */
-            lower = middle+1;
-        } else { /* key < base[middle] */
-            upper = middle-1;
-        }
-    }
-    
-    if( lower < 0 ) {
-        *pos = 0;
-    } else {
-        *pos = lower;
-    }
-    return 0;
-}
+static apr_pool_t *chain_pool;          /* per child, chains compiled so far */
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *chain_mutex;
+#endif
+#ifndef APACHE24
+static server_rec *main_server = NULL;  /* the monitor hook gets no server_rec */
+#endif
+static int conf_counter = 0;            /* highest conf_id + 1 */
+static apr_array_header_t *conf_reg;    /* the scopes given a conf_id while parsing */
+static dirlimit_dirconfig *conf_list;   /* indexed by conf_id, built in post_config */
+static int conf_size = 0;               /* entries of conf_list, covers every slot */
+static apr_hash_t *ident_seen;          /* occurrences of each path while parsing */
+static apr_hash_t *prev_ids;            /* scope of the previous generation -> its conf_id */
+static apr_array_header_t *prev_free;   /* slots free there, the lowest at the top */
+static int prev_slots;                  /* the next conf_id past the old segment */
 
-static int dirlimit_statushandler(request_rec *r)
+/* what outlives a graceful restart, per server in the process pool */
+typedef struct {
+    apr_shm_t *shm;
+    const char *shm_file;
+    apr_global_mutex_t *mutex;
+    apr_uint32_t generation;
+} dirlimit_persist;
+
+#define SNAPSHOT_TRIES              64
+#define SWEEP_STEP                  1024    /* buckets per second swept by the parent */
+
+/* copy of the shared state, rendered after the mutex is released */
+typedef struct {
+    uint64_t n_total;
+    uint64_t n_rejected;
+    uint64_t n_ratelimited;
+    uint64_t n_lockerror;
+    uint64_t n_tablefull;
+    uint64_t n_clientfull;
+    uint64_t n_namefull;
+    uint64_t n_ownerfull;
+    uint64_t n_reaped;
+    uint64_t n_reclaimed;
+    int clients_num;
+    int clients_size;
+    int slots_num;
+    dirlimit_slot *slots;
+    int table_size;
+    int records_size;
+    int records_num;
+    dirlimit_record *records;
+    int *pos;
+    char *names;                /* the name arena, see dirlimit_record_name() */
+} dirlimit_snapshot;
+
+static apr_status_t take_snapshot( apr_pool_t *p, dirlimit_sconfig *conf, dirlimit_snapshot *snap )
 {
-    apr_status_t status = APR_SUCCESS;
-    dirlimit_sconfig *conf =
-        ap_get_module_config(r->server->module_config, &dirlimit_module);
-    int i, slot, limit, limit_script;
-    const char *path;
+    apr_status_t status;
+    int i, n;
 
-    if (strcmp(r->handler, "dirlimit-status")) {
-        return DECLINED;
+    snap->n_total = conf->eng.shm->n_total;
+    snap->n_rejected = conf->eng.shm->n_rejected;
+    snap->n_ratelimited = conf->eng.shm->n_ratelimited;
+    snap->n_lockerror = conf->eng.shm->n_lockerror;
+    snap->n_tablefull = conf->eng.shm->n_tablefull;
+    snap->n_clientfull = conf->eng.shm->n_clientfull;
+    snap->n_namefull = conf->eng.shm->n_namefull;
+    snap->n_ownerfull = conf->eng.shm->n_ownerfull;
+    snap->n_reaped = conf->eng.shm->n_reaped;
+    snap->n_reclaimed = conf->eng.shm->n_reclaimed;
+    snap->clients_num = conf->eng.shm->clients_num;
+    snap->clients_size = conf->eng.shm->clients_size;
+
+    /* per-dir counters are atomic, no lock needed */
+    snap->slots_num = conf->eng.shm->slots_num;
+    snap->slots = apr_palloc( p, sizeof(dirlimit_slot) * snap->slots_num );
+    for( i=0; i<snap->slots_num; i++ ) {
+        snap->slots[i] = conf->eng.slots[i];
     }
 
-    status = apr_global_mutex_lock(conf->mutex);
+    snap->table_size = conf->eng.shm->table_size;
+    snap->records_size = conf->eng.shm->records_size;
+    snap->records = apr_palloc( p, sizeof(dirlimit_record) * snap->records_size );
+    snap->pos = apr_palloc( p, sizeof(int) * snap->records_size );
+    snap->names = apr_palloc( p, conf->eng.shm->names_size );
+
+    /* the mutex only if the request path keeps the table busy */
+    n = dirlimit_read_records( &conf->eng, snap->records, snap->pos, snap->names, SNAPSHOT_TRIES );
+    if( n >= 0 ) {
+        snap->records_num = n;
+        return APR_SUCCESS;
+    }
+    status = dirlimit_lock( &conf->eng );
     if( status != APR_SUCCESS ) {
-        ERRORLOG("mod_dirlimit: global mutex lock faild(statushandler)");
-        return HTTP_INTERNAL_SERVER_ERROR;
+        return status;
     }
-    
     /* locked */
         DEBUGLOG("global mutex locked(statushandler)");
-        r->no_cache = 1;
-        r->content_type = "text/plain";
-        ap_rprintf( r, "total_count: %ld\nrejected_count: %ld"
-            "\nlockerror_count: %ld\n",
-            *(conf->n_total), *(conf->n_rejected), *(conf->n_lockerror) );
-        ap_rprintf(r, "\nlimit records:\n"
-            "rec slt| cnt / lim|scnt /slim| cid|%15s dirname\n", "path");
-        for(i=0; i</* *(conf->records_num) */conf->records_size; i++ ) {
-            slot = (int)(conf->records[i].dirname - conf->strdata) / MAX_DIRNAME;
-            if( i == *(conf->records_num) ) {
-                ap_rprintf(r,"------\n");
-            }
-            if( i < *(conf->records_num) ) {
-                if( conf->records[i].dirname[0] == '\0' ) {
-                    limit = conf_list[ conf->records[i].conf_id ].limit;
-                    limit_script = conf_list[ conf->records[i].conf_id ].limit_script;
-                } else {
-                    limit = conf_list[ conf->records[i].conf_id ].limit_sub;
-                    limit_script = conf_list[ conf->records[i].conf_id ].limit_sub_script;
-                }
-                path = conf_list[ conf->records[i].conf_id ].path;
-            } else {
-                limit = 0;
-                limit_script = 0;
-                path = "null";
+        n = 0;
+        for( i=0; i<snap->table_size && n<snap->records_size; i++ ) {
+            if( conf->eng.records[i].conf_id < 0 ) {
+                continue;
             }
-            ap_rprintf( r, "%3d %3d|%4d /%4d|%4d /%4d|%4d|%15s %s\n",
-                i, slot, conf->records[i].counter, limit,
-                conf->records[i].counter_script, limit_script,
-                conf->records[i].conf_id, path, conf->records[i].dirname );
+            snap->records[n] = conf->eng.records[i];
+            snap->pos[n] = i;
+            n++;
         }
+        memcpy( snap->names, conf->eng.names, conf->eng.shm->names_size );
     /************/
-    
-    status = apr_global_mutex_unlock(conf->mutex);
-
+    status = dirlimit_unlock( &conf->eng );
     DEBUGLOG("global mutex unlocked(statushandler)");
-    return OK;
+
+    snap->records_num = n;
+    return APR_SUCCESS;
 }
 
-static int compare_record( const void *keyv, const void *rv )
+static inline int slot_in_use( int conf_id )
 {
-    dirlimit_record *key, *r;
-    key = (dirlimit_record*)keyv;
-    r = (dirlimit_record*)rv;
-    const char *keydir;
-    
-    keydir = key->dirname;
-    if( keydir == NULL ) {
-        keydir = "";
-    }
-    
-    DEBUGLOG("compare: id:%d dir:'%s' <> id:%d dir:'%s'",
-            key->conf_id, keydir, r->conf_id, r->dirname);
-    
-    if( key->conf_id > r->conf_id ) {
-        return 1;
-    } else if( key->conf_id < r->conf_id ) {
-        return -1;
-    }
-    return strncmp( keydir, r->dirname, MAX_DIRNAME-1 );
+    return conf_list[conf_id].path != NULL && ( conf_list[conf_id].limit >= 0 ||
+        conf_list[conf_id].limit_script >= 0 || conf_list[conf_id].adaptive_max > 0 );
+}
+
+static inline int adaptive_in_use( int conf_id )
+{
+    return conf_list[conf_id].path != NULL && conf_list[conf_id].adaptive_max > 0;
 }
 
-/* partly sort */
-static inline void swap_slot( dirlimit_sconfig *conf )
+static inline int sub_in_use( int conf_id )
 {
-    dirlimit_record *r = conf->records;
-    size_t n = *(conf->records_num);
-    char *t;
+    return conf_list[conf_id].path != NULL &&
+        ( conf_list[conf_id].limit_sub >= 0 || conf_list[conf_id].limit_sub_script >= 0 );
+}
 
-    if( n > conf->records_size - 2 ) {
-        return;
+/* the limit in effect: a dirlimit-admin override, DirLimitAdaptive or the config */
+static inline int limit_in_effect( int conf_id, const dirlimit_slot *slot, int which )
+{
+    const dirlimit_dirconfig *dc = &conf_list[conf_id];
+
+    if( slot->overridden && slot->override[which] != DIRLIMIT_KEEP ) {
+        return slot->override[which];
     }
-    if( r[n].dirname > r[n+1].dirname ) {
-        t = r[n].dirname;
-        r[n].dirname = r[n+1].dirname;
-        r[n+1].dirname = t;
+    switch( which ) {
+    case DIRLIMIT_OV_LIMIT:
+        return adaptive_in_use(conf_id) ? (int)slot->limit_eff : dc->limit;
+    case DIRLIMIT_OV_LIMIT_SCRIPT:
+        return dc->limit_script;
+    case DIRLIMIT_OV_SUB:
+        return dc->limit_sub;
     }
+    return dc->limit_sub_script;
 }
 
-static int search_record( dirlimit_sconfig *conf, const dirlimit_record *key, size_t *pos )
+static inline int dir_limit( int conf_id, const dirlimit_slot *slot )
 {
-    return binsearch( key, conf->records, *(conf->records_num),
-        sizeof(dirlimit_record), pos, compare_record );
+    return limit_in_effect( conf_id, slot, DIRLIMIT_OV_LIMIT );
 }
 
-static void insert_record( dirlimit_sconfig *conf, dirlimit_record *key, size_t pos )
+static inline int conf_in_use( int conf_id )
 {
-    dirlimit_record *rs = conf->records;
-    size_t n = *(conf->records_num);
-    char *dirname;
-    
-    dirname = rs[n].dirname;
-    memmove( &rs[pos+1], &rs[pos], sizeof(dirlimit_record)*(n-pos) );
-    /*int i,ct;
-    for( ct=0,i=n; i>=pos+1; i-- ) {
-        rs[i].conf_id = rs[i-1].conf_id;
-        rs[i].dirname = rs[i-1].dirname;
-        rs[i].counter = rs[i-1].counter;
-        rs[i].counter_script = rs[i-1].counter_script;
-        ct++;
-    }*/
-    rs[pos].dirname = dirname;
-    //DEBUGLOG("inserting: %d record moved", ct);
-    
-    DEBUGLOG("inserting: key->dirname=%s", key->dirname);
-    if( key->dirname == NULL ) {
-        rs[pos].dirname[0] = '\0';
-    } else {
-        strncpy( rs[pos].dirname, key->dirname, MAX_DIRNAME-1 );
-        rs[pos].dirname[MAX_DIRNAME-1] = '\0';
-    }
-    rs[pos].conf_id = key->conf_id;
-    rs[pos].counter = 0;
-    rs[pos].counter_script = 0;
-    (*(conf->records_num))++;
-    DEBUGLOG("insert_record: rs[pos].dirname=%s", rs[pos].dirname);
-    DEBUGLOG("insert_record: pos=%d records_num=%d", (int)pos, (int)*(conf->records_num) );
+    return conf_list[conf_id].path != NULL;
 }
 
-static void remove_record( dirlimit_sconfig *conf, size_t pos )
+/* the name of a subdir record, or its hash if the arena had no room */
+static const char *record_name( apr_pool_t *p, const char *names, const dirlimit_record *rec )
 {
-    dirlimit_record *r = conf->records;
-    size_t n = *(conf->records_num);
-    char *dirname = r[pos].dirname;
-    
-    memmove( &r[pos], &r[pos+1], sizeof(dirlimit_record)*(n-pos-1) );
-    /*int i;
-    for( i=pos; i<n-1; i++ ) {
-        r[i].dirname = r[i+1].dirname;
-        r[i].counter = r[i+1].counter;
-    }*/
-    
-    r[n-1].dirname = dirname;
-    //r[n-1].dirname[0] = '\0';
-    //r[n-1].counter = 0;
-    (*(conf->records_num))--;
-    DEBUGLOG("remove_record: pos=%d records_num=%d", (int)pos, (int)*(conf->records_num) );
-    
-    swap_slot(conf);
+    const char *name = dirlimit_record_name( names, rec );
+    return name ? name : apr_psprintf( p, "#%016" APR_UINT64_T_HEX_FMT, (apr_uint64_t)rec->hash );
 }
 
-static inline char *get_dirname( apr_pool_t *pool, const char *path, int pathdepth )
+/* records of a scope gone from the config may still be counting */
+static inline const char *conf_path( int conf_id )
 {
-    int i=0;
-    const char *p = path;
-    if( *p == '/' ) {
-        p++;
-    }
-    for(i=0; i<pathdepth; p++ ) {
-        if( *p == '/' ) {
-            i++;
-        } else if( *p == '\0' ) {
-            return apr_pstrdup( pool, "!!nuknown dir!!" );
+    return conf_list[conf_id].path ? conf_list[conf_id].path : "null";
+}
+
+static inline int client_in_use( int conf_id )
+{
+    return conf_list[conf_id].path != NULL &&
+        ( conf_list[conf_id].limit_client >= 0 || conf_list[conf_id].limit_client_script >= 0 );
+}
+
+static inline int lease_in_use( int conf_id )
+{
+    return conf_list[conf_id].path != NULL && conf_list[conf_id].lease > 0;
+}
+
+static inline int reserve_in_use( int conf_id )
+{
+    return conf_list[conf_id].path != NULL && conf_list[conf_id].reserves_num > 0;
+}
+
+static inline int bw_in_use( int conf_id )
+{
+    const dirlimit_dirconfig *dc = &conf_list[conf_id];
+    return dc->path != NULL && ( dc->bw.rate > 0 || dc->bw_script.rate > 0 ||
+        dc->bw_sub.rate > 0 || dc->bw_sub_script.rate > 0 );
+}
+
+static inline int rate_in_use( int conf_id )
+{
+    return conf_list[conf_id].path != NULL &&
+        ( conf_list[conf_id].rate.rate > 0 || conf_list[conf_id].rate_sub.rate > 0 );
+}
+
+#define STAT_KINDS 3
+static const int stat_kind[] = { LEVEL_DIR, LEVEL_SUB, LEVEL_CLIENT };
+static const char *stat_name[] = { "dir", "sub", "client" };
+
+static inline const dirlimit_stat *slot_stat( const dirlimit_slot *slot, int i )
+{
+    return stat_of( (dirlimit_slot*)slot, stat_kind[i] );
+}
+
+static const char *json_escape( apr_pool_t *p, const char *str )
+{
+    char *out, *o;
+    const unsigned char *s;
+
+    o = out = apr_palloc( p, strlen(str) * 6 + 1 );
+    for( s = (const unsigned char*)str; *s; s++ ) {
+        if( *s == '"' || *s == '\\' ) {
+            *o++ = '\\';
+            *o++ = *s;
+        } else if( *s < 0x20 ) {
+            o += apr_snprintf( o, 7, "\\u%04x", *s );
+        } else {
+            *o++ = *s;
         }
     }
-    return ap_getword( pool, &p, '/' );
+    *o = '\0';
+    return out;
 }
 
-static inline int get_pathdepth( const char *path )
+static void render_text( request_rec *r, const dirlimit_snapshot *snap )
 {
-    int i,l,c=0;
-    const char *p = path;
-    if( p[0] == '/' ) {
-        p++;
+    const dirlimit_record *rec;
+    const dirlimit_slot *slot;
+    const dirlimit_stat *st;
+    int i, j, b, sub;
+
+    ap_set_content_type( r, "text/plain" );
+    ap_rprintf( r, "total_count: %" APR_UINT64_T_FMT "\nrejected_count: %" APR_UINT64_T_FMT
+        "\nratelimited_count: %" APR_UINT64_T_FMT "\nlockerror_count: %" APR_UINT64_T_FMT
+        "\nreclaimed_count: %" APR_UINT64_T_FMT " (of %" APR_UINT64_T_FMT " dead owners)"
+        "\nuntracked_count: %" APR_UINT64_T_FMT "\n",
+        snap->n_total, snap->n_rejected, snap->n_ratelimited, snap->n_lockerror,
+        snap->n_reclaimed, snap->n_reaped, snap->n_ownerfull );
+
+    ap_rprintf(r, "\ndir records:\n"
+        " cid| cnt / lim|scnt /slim|%15s\n", "path");
+    for( i=0; i<snap->slots_num; i++ ) {
+        if( !slot_in_use(i) ) {
+            continue;
+        }
+        ap_rprintf( r, "%4d|%4d /%4d|%4d /%4d|%15s\n",
+            i, (int)snap->slots[i].counter, dir_limit( i, &snap->slots[i] ),
+            (int)snap->slots[i].counter_script,
+            limit_in_effect( i, &snap->slots[i], DIRLIMIT_OV_LIMIT_SCRIPT ),
+            conf_list[i].path );
     }
-    l = strlen(p) - 1;
-    if( l > 0 ) {
-        c++;
+
+    ap_rprintf(r, "\nper-client limits: %d / %d entries\n"
+        " cid| lim|slim|  reject|%15s\n", snap->clients_num, snap->clients_size, "path");
+    for( i=0; i<snap->slots_num; i++ ) {
+        if( !client_in_use(i) ) {
+            continue;
+        }
+        ap_rprintf( r, "%4d|%4d|%4d|%8u|%15s\n",
+            i, conf_list[i].limit_client, conf_list[i].limit_client_script,
+            snap->slots[i].client.rejected, conf_list[i].path );
     }
-    for( i=0; i<l; i++ ) {
-        if( p[i] == '/' ) {
-            c++;
+
+    ap_rprintf(r, "\nadaptive limits (lim above is the effective one):\n"
+        " cid| min| max| eff|    up|  down|base(ms)|%15s\n", "path");
+    for( i=0; i<snap->slots_num; i++ ) {
+        if( !adaptive_in_use(i) ) {
+            continue;
         }
+        ap_rprintf( r, "%4d|%4d|%4d|%4u|%6u|%6u|%8.1f|%15s\n",
+            i, conf_list[i].adaptive_min, conf_list[i].adaptive_max,
+            snap->slots[i].limit_eff, snap->slots[i].adapt_up, snap->slots[i].adapt_down,
+            (double)snap->slots[i].adapt_base_usec / 1000, conf_list[i].path );
     }
-    return c;
-}
 
-static int check_limit( dirlimit_sconfig *sconf, dirlimit_record *r, int limit, const char* type )
-{
-    size_t ret, pos;
+    ap_rprintf(r, "\noverrides (dirlimit-admin; lim above is the one in effect):\n"
+        " cid| lim|slim| sub|ssub|     since|%15s\n", "path");
+    for( i=0; i<snap->slots_num; i++ ) {
+        slot = &snap->slots[i];
+        if( !conf_in_use(i) || !slot->overridden ) {
+            continue;
+        }
+        ap_rprintf( r, "%4d|%4d|%4d|%4d|%4d|%10u|%15s\n", i,
+            limit_in_effect( i, slot, DIRLIMIT_OV_LIMIT ),
+            limit_in_effect( i, slot, DIRLIMIT_OV_LIMIT_SCRIPT ),
+            limit_in_effect( i, slot, DIRLIMIT_OV_SUB ),
+            limit_in_effect( i, slot, DIRLIMIT_OV_SUB_SCRIPT ),
+            slot->override_time, conf_list[i].path );
+    }
 
-    ret = search_record( sconf, r, &pos );
-    DEBUGLOG("pos:%d ret:%d", (int)pos, (int)ret);
-    if( ! ret ) {
-        if( *sconf->records_num >= sconf->records_size ) {
-            ERRORLOG("mod_dirlimit: reached maxclients");
-            (*(sconf->n_rejected))++;
-            return -1;
+    ap_rprintf(r, "\nreserves (used: per-dir units now, taken: all beyond the general share):\n"
+        " cid|%20s|  num| used|   taken|%15s\n", "class", "path");
+    for( i=0; i<snap->slots_num; i++ ) {
+        if( !reserve_in_use(i) ) {
+            continue;
+        }
+        for( j=0; j<conf_list[i].reserves_num; j++ ) {
+            ap_rprintf( r, "%4d|%20s|%5d|%5u|%8" APR_UINT64_T_FMT "|%15s\n",
+                i, conf_list[i].reserves[j].name, conf_list[i].reserves[j].num,
+                snap->slots[i].reserved[j], snap->slots[i].reserve_taken, conf_list[i].path );
         }
-        DEBUGLOG("inserting: pos=%d", (int)pos);
-        insert_record( sconf, r, pos );
-        DEBUGLOG("inserted: pos=%d", (int)pos);
     }
-    if( type == SCRIPT_TYPE ) {
-        if( limit >= 0 && sconf->records[pos].counter_script >= limit ) {
-            ERRORLOG("mod_dirlimit: reached per-dir script limit");
-            (*(sconf->n_rejected))++;
-            return -1;
+
+    ap_rprintf(r, "\nleases (cnt above includes leased units):\n"
+        " cid|batch|  min|  refill|  return|%15s\n", "path");
+    for( i=0; i<snap->slots_num; i++ ) {
+        if( !lease_in_use(i) ) {
+            continue;
         }
-        (sconf->records[pos].counter_script)++;
-        return sconf->records[pos].counter_script;
-    } else {
-        if( limit >= 0 && sconf->records[pos].counter >= limit ) {
-            ERRORLOG("mod_dirlimit: reached per-dir connection limit");
-            (*(sconf->n_rejected))++;
-            return -1;
+        ap_rprintf( r, "%4d|%5d|%5d|%8u|%8u|%15s\n",
+            i, conf_list[i].lease, conf_list[i].lease_min,
+            snap->slots[i].lease_refill, snap->slots[i].lease_return, conf_list[i].path );
+    }
+
+    ap_rprintf(r, "\nreclaimed from dead children:\n"
+        " cid|counters|  leased|%15s\n", "path");
+    for( i=0; i<snap->slots_num; i++ ) {
+        slot = &snap->slots[i];
+        if( !conf_in_use(i) || (slot->reclaimed == 0 && slot->reclaimed_lease == 0) ) {
+            continue;
         }
-        (sconf->records[pos].counter)++;
-        return sconf->records[pos].counter;
+        ap_rprintf( r, "%4d|%8u|%8u|%15s\n",
+            i, slot->reclaimed, slot->reclaimed_lease, conf_list[i].path );
     }
-    return -1;
-}
 
-static int dirlimit_check_limit(request_rec *r)
-{
-    apr_status_t status = APR_SUCCESS;
-    dirlimit_sconfig *sconf =
-        ap_get_module_config(r->server->module_config, &dirlimit_module);
-    dirlimit_dirconfig *dirconf, *dc;
-    dirconf = ap_get_module_config(r->per_dir_config, &dirlimit_module);
-    dirlimit_record record;
-    int ret, limit;
-    const char *type;
-    
-    /* is sub request ? */
-    if( r->main || r->prev ) {
-        DEBUGLOG("pass: it is sub request %s", r->filename);
-        return OK;
+    ap_rprintf(r, "\nwait queues:\n"
+        " cid| now/ max|  waited|timeout|   full| avg(ms)|%15s\n", "path");
+    for( i=0; i<snap->slots_num; i++ ) {
+        slot = &snap->slots[i];
+        if( !slot_in_use(i) || slot->waited == 0 ) {
+            continue;
+        }
+        ap_rprintf( r, "%4d|%4u/%4u|%8u|%7u|%7u|%8.1f|%15s\n",
+            i, slot->waiters, slot->wait_max_depth, slot->waited,
+            slot->wait_timeout, slot->wait_full,
+            (double)slot->wait_usec / slot->waited / 1000, conf_list[i].path );
     }
-    
-    DEBUGLOG("fixup: %s", r->filename );
 
-    //return OK;
+    ap_rprintf(r, "\nrates (req/s):\n"
+        " cid|   rate| burst|  reject| persub| burst|  reject|%15s\n", "path");
+    for( i=0; i<snap->slots_num; i++ ) {
+        if( !rate_in_use(i) ) {
+            continue;
+        }
+        ap_rprintf( r, "%4d|%7d|%6d|%8u|%7d|%6d|%8u|%15s\n",
+            i, (int)conf_list[i].rate.rate, (int)conf_list[i].rate.burst,
+            snap->slots[i].dir.rate_rejected,
+            (int)conf_list[i].rate_sub.rate, (int)conf_list[i].rate_sub.burst,
+            snap->slots[i].sub.rate_rejected, conf_list[i].path );
+    }
 
-    /******* Lock *******/
-    status = apr_global_mutex_lock(sconf->mutex);
-    if(status == APR_SUCCESS){
-        DEBUGLOG("global mutex locked(check_limit)");
-    } else {
-        ERRORLOG("mod_dirlimit: global mutex lock faild(check_limit)");
-        (*(sconf->n_lockerror))++;
-        return HTTP_INTERNAL_SERVER_ERROR;
+    ap_rprintf(r, "\nbandwidth (bytes/s):\n"
+        " cid|      rate|    script|    persub| scriptsub|           bytes| delay(ms)|%15s\n", "path");
+    for( i=0; i<snap->slots_num; i++ ) {
+        if( !bw_in_use(i) ) {
+            continue;
+        }
+        ap_rprintf( r, "%4d|%10" APR_UINT64_T_FMT "|%10" APR_UINT64_T_FMT "|%10" APR_UINT64_T_FMT
+            "|%10" APR_UINT64_T_FMT "|%16" APR_UINT64_T_FMT "|%10" APR_UINT64_T_FMT "|%15s\n",
+            i, conf_list[i].bw.rate, conf_list[i].bw_script.rate,
+            conf_list[i].bw_sub.rate, conf_list[i].bw_sub_script.rate,
+            snap->slots[i].bw_bytes, snap->slots[i].bw_delay_usec / 1000, conf_list[i].path );
     }
-    
-    /******* Locked *******/
-    (*(sconf->n_total))++;
-    
-    dc = dirconf;
-    while(dc)
-    {
-        DEBUGLOG("%d:%s ->", dc->conf_id, dc->path);
-        dc = dc->parent;
-    }
-    dc = dirconf;
-    while( dc ) {
-        type = apr_table_get( dc->script_types, r->handler );
-        if( type != NULL ) { break; }
-        dc = dc->parent;
-    }
-    apr_table_setn( r->notes, DIRLIMIT_ORIGTYPE, type );
-    if( type == SCRIPT_TYPE ) {
-        ERRORLOG( "!!!!script type!!" );
-    } else if( type == NO_SCRIPT_TYPE ) {
-        ERRORLOG( "!!!!no script type!!" );
-    } else {
-        ERRORLOG("!!!unknown!!");
+
+    ap_rprintf(r, "\nhold time (ms):\n"
+        " cid|   |  accept|  reject| hwm| avg(ms)|");
+    for( b=0; b<HIST_BUCKETS-1; b++ ) {
+        ap_rprintf( r, "%6d", 1 << b );
     }
-    
-    dc = dirconf;
-    while(dc) {
-        record.conf_id = dc->conf_id;
-        DEBUGLOG("aaaaaaa");
-        /* per-dir */
-        if( dc->limit >= 0  || dc->limit_script >= 0 ) {
-            record.dirname = "";
-            limit = dc->limit;
-            if( type == SCRIPT_TYPE ) {
-                limit = dc->limit_script;
+    ap_rprintf( r, "%6s|%15s\n", "inf", "path" );
+    for( i=0; i<snap->slots_num; i++ ) {
+        if( !conf_in_use(i) ) {
+            continue;
+        }
+        for( sub=0; sub<STAT_KINDS; sub++ ) {
+            st = slot_stat( &snap->slots[i], sub );
+            if( st->accepted == 0 && st->rejected == 0 ) {
+                continue;
             }
-            ret = check_limit( sconf, &record, limit, type );
-            if( ret < 0 ) {
-                status = apr_global_mutex_unlock(sconf->mutex);
-                return HTTP_SERVICE_UNAVAILABLE;
+            ap_rprintf( r, "%4d|%3s|%8u|%8u|%4u|%8.1f|",
+                i, stat_name[sub], st->accepted, st->rejected, st->max_counter,
+                st->accepted ? (double)st->hold_usec / st->accepted / 1000 : 0.0 );
+            for( b=0; b<HIST_BUCKETS; b++ ) {
+                ap_rprintf( r, "%6u", st->hist[b] );
             }
-            DEBUGLOG("access_ok(per-dir): counter=%d limit=%d", ret, dc->limit);
-        }
-        /* per-subdir */
-        if( dc->limit_sub >= 0 || dc->limit_sub_script >= 0 ) {
-            record.dirname = get_dirname( r->pool, r->filename, dc->pathdepth );
-            DEBUGLOG("per-sub dirname %s",record.dirname);
-            limit = dc->limit_sub;
-            if( type == SCRIPT_TYPE ) {
-                limit = dc->limit_sub_script;
+            ap_rprintf( r, "|%15s\n", conf_list[i].path );
+        }
+    }
+
+    ap_rprintf(r, "\nsubdir records: %d / %d\n"
+        " pos home| cnt / lim|scnt /slim|  accept|  reject| hwm| cid|%15s dirname\n",
+        snap->records_num, snap->records_size, "path");
+    for( i=0; i<snap->records_num; i++ ) {
+        rec = &snap->records[i];
+        ap_rprintf( r, "%4d %4d|%4d /%4d|%4d /%4d|%8u|%8u|%4u|%4d|%15s %s\n",
+            snap->pos[i], (int)(rec->hash & (snap->table_size - 1)),
+            rec->counter,
+            limit_in_effect( rec->conf_id, &snap->slots[rec->conf_id], DIRLIMIT_OV_SUB ),
+            rec->counter_script,
+            limit_in_effect( rec->conf_id, &snap->slots[rec->conf_id], DIRLIMIT_OV_SUB_SCRIPT ),
+            rec->accepted, rec->rejected, rec->max_counter,
+            rec->conf_id, conf_path( rec->conf_id ), record_name( r->pool, snap->names, rec ) );
+    }
+}
+
+/* "key: value" lines in the manner of mod_status ?auto */
+static void render_auto( request_rec *r, const dirlimit_snapshot *snap )
+{
+    const dirlimit_record *rec;
+    const dirlimit_stat *st;
+    int i, j, b, sub;
+
+    ap_set_content_type( r, "text/plain" );
+    ap_rprintf( r, "Total: %" APR_UINT64_T_FMT "\nRejected: %" APR_UINT64_T_FMT
+        "\nRateLimited: %" APR_UINT64_T_FMT
+        "\nLockError: %" APR_UINT64_T_FMT "\nTableFull: %" APR_UINT64_T_FMT
+        "\nNameFull: %" APR_UINT64_T_FMT "\nRecords: %d\nRecordsSize: %d"
+        "\nClients: %d\nClientsSize: %d\nClientFull: %" APR_UINT64_T_FMT
+        "\nReclaimed: %" APR_UINT64_T_FMT "\nReaped: %" APR_UINT64_T_FMT
+        "\nUntracked: %" APR_UINT64_T_FMT "\n",
+        snap->n_total, snap->n_rejected, snap->n_ratelimited,
+        snap->n_lockerror, snap->n_tablefull, snap->n_namefull,
+        snap->records_num, snap->records_size,
+        snap->clients_num, snap->clients_size, snap->n_clientfull,
+        snap->n_reclaimed, snap->n_reaped, snap->n_ownerfull );
+    for( i=0; i<snap->slots_num; i++ ) {
+        if( !slot_in_use(i) ) {
+            continue;
+        }
+        ap_rprintf( r, "Dir: %d %d %d %d %d %u %s\n",
+            i, (int)snap->slots[i].counter, dir_limit( i, &snap->slots[i] ),
+            (int)snap->slots[i].counter_script,
+            limit_in_effect( i, &snap->slots[i], DIRLIMIT_OV_LIMIT_SCRIPT ),
+            snap->slots[i].dir.rejected, conf_list[i].path );
+        if( snap->slots[i].waited > 0 ) {
+            ap_rprintf( r, "Wait: %d %u %u %u %u %u %" APR_UINT64_T_FMT "\n",
+                i, snap->slots[i].waiters, snap->slots[i].wait_max_depth,
+                snap->slots[i].waited, snap->slots[i].wait_timeout,
+                snap->slots[i].wait_full, snap->slots[i].wait_usec );
+        }
+    }
+    for( i=0; i<snap->slots_num; i++ ) {
+        if( !adaptive_in_use(i) ) {
+            continue;
+        }
+        ap_rprintf( r, "Adaptive: %d %d %d %u %u %u %" APR_UINT64_T_FMT " %s\n",
+            i, conf_list[i].adaptive_min, conf_list[i].adaptive_max,
+            snap->slots[i].limit_eff, snap->slots[i].adapt_up, snap->slots[i].adapt_down,
+            snap->slots[i].adapt_base_usec, conf_list[i].path );
+    }
+    for( i=0; i<snap->slots_num; i++ ) {
+        if( !conf_in_use(i) || !snap->slots[i].overridden ) {
+            continue;
+        }
+        ap_rprintf( r, "Override: %d %d %d %d %d %u %s\n", i,
+            limit_in_effect( i, &snap->slots[i], DIRLIMIT_OV_LIMIT ),
+            limit_in_effect( i, &snap->slots[i], DIRLIMIT_OV_LIMIT_SCRIPT ),
+            limit_in_effect( i, &snap->slots[i], DIRLIMIT_OV_SUB ),
+            limit_in_effect( i, &snap->slots[i], DIRLIMIT_OV_SUB_SCRIPT ),
+            snap->slots[i].override_time, conf_list[i].path );
+    }
+    for( i=0; i<snap->slots_num; i++ ) {
+        if( !reserve_in_use(i) ) {
+            continue;
+        }
+        for( j=0; j<conf_list[i].reserves_num; j++ ) {
+            ap_rprintf( r, "Reserve: %d %d %s %d %u %" APR_UINT64_T_FMT " %s\n",
+                i, j, conf_list[i].reserves[j].name, conf_list[i].reserves[j].num,
+                snap->slots[i].reserved[j], snap->slots[i].reserve_taken, conf_list[i].path );
+        }
+    }
+    for( i=0; i<snap->slots_num; i++ ) {
+        if( !lease_in_use(i) ) {
+            continue;
+        }
+        ap_rprintf( r, "Lease: %d %d %d %u %u %s\n",
+            i, conf_list[i].lease, conf_list[i].lease_min,
+            snap->slots[i].lease_refill, snap->slots[i].lease_return, conf_list[i].path );
+    }
+    for( i=0; i<snap->slots_num; i++ ) {
+        if( !conf_in_use(i) ||
+                (snap->slots[i].reclaimed == 0 && snap->slots[i].reclaimed_lease == 0) ) {
+            continue;
+        }
+        ap_rprintf( r, "Reclaim: %d %u %u %s\n",
+            i, snap->slots[i].reclaimed, snap->slots[i].reclaimed_lease, conf_list[i].path );
+    }
+    for( i=0; i<snap->slots_num; i++ ) {
+        if( !client_in_use(i) ) {
+            continue;
+        }
+        ap_rprintf( r, "Client: %d %d %d %u %s\n",
+            i, conf_list[i].limit_client, conf_list[i].limit_client_script,
+            snap->slots[i].client.rejected, conf_list[i].path );
+    }
+    for( i=0; i<snap->slots_num; i++ ) {
+        if( !rate_in_use(i) ) {
+            continue;
+        }
+        ap_rprintf( r, "Rate: %d %d %d %u %d %d %u %s\n",
+            i, (int)conf_list[i].rate.rate, (int)conf_list[i].rate.burst,
+            snap->slots[i].dir.rate_rejected,
+            (int)conf_list[i].rate_sub.rate, (int)conf_list[i].rate_sub.burst,
+            snap->slots[i].sub.rate_rejected, conf_list[i].path );
+    }
+    for( i=0; i<snap->slots_num; i++ ) {
+        if( !bw_in_use(i) ) {
+            continue;
+        }
+        ap_rprintf( r, "Bandwidth: %d %" APR_UINT64_T_FMT " %" APR_UINT64_T_FMT
+            " %" APR_UINT64_T_FMT " %" APR_UINT64_T_FMT " %" APR_UINT64_T_FMT
+            " %" APR_UINT64_T_FMT " %s\n",
+            i, conf_list[i].bw.rate, conf_list[i].bw_script.rate,
+            conf_list[i].bw_sub.rate, conf_list[i].bw_sub_script.rate,
+            snap->slots[i].bw_bytes, snap->slots[i].bw_delay_usec, conf_list[i].path );
+    }
+    for( i=0; i<snap->slots_num; i++ ) {
+        if( !conf_in_use(i) ) {
+            continue;
+        }
+        for( sub=0; sub<STAT_KINDS; sub++ ) {
+            st = slot_stat( &snap->slots[i], sub );
+            if( st->accepted == 0 && st->rejected == 0 ) {
+                continue;
             }
-            ret = check_limit( sconf, &record, limit, type );
-            if( ret < 0 ) {
-                status = apr_global_mutex_unlock(sconf->mutex);
-                return HTTP_SERVICE_UNAVAILABLE;
+            ap_rprintf( r, "Hold: %d %s %u %u %u %" APR_UINT64_T_FMT,
+                i, stat_name[sub], st->accepted, st->rejected, st->max_counter, st->hold_usec );
+            for( b=0; b<HIST_BUCKETS; b++ ) {
+                ap_rprintf( r, " %u", st->hist[b] );
             }
-            DEBUGLOG("access_ok(per-subdir): counter=%d limit=%d", ret, dc->limit);
+            ap_rputs( "\n", r );
         }
-        
-        DEBUGLOG("dirconf parent: %lX -> %lX", (long int)dc, (long int)dc->parent);
-        dc = dc->parent;
     }
-    
-    /******* Unlock *******/
-    status = apr_global_mutex_unlock(sconf->mutex);
-    
-    apr_table_set( r->notes, DIRLIMIT_ORIGPATH, r->filename );
-    
-    /*uint64_t i,j;
-    j = (uint64_t)time(NULL);
-    for(i=1;i<1000000;i++) {
-        j += (j%i);
+    for( i=0; i<snap->records_num; i++ ) {
+        rec = &snap->records[i];
+        ap_rprintf( r, "Sub: %d %d %d %d %d %u %u %u %s %s\n",
+            rec->conf_id, rec->counter,
+            limit_in_effect( rec->conf_id, &snap->slots[rec->conf_id], DIRLIMIT_OV_SUB ),
+            rec->counter_script,
+            limit_in_effect( rec->conf_id, &snap->slots[rec->conf_id], DIRLIMIT_OV_SUB_SCRIPT ),
+            rec->rejected, rec->accepted, rec->max_counter,
+            conf_path( rec->conf_id ), record_name( r->pool, snap->names, rec ) );
     }
-    DEBUGLOG("test:%ld", j);*/
-
-    DEBUGLOG("global mutex unlocked(check_limit)");
-    return OK;
 }
 
-static int dirlimit_response_end(request_rec *r)
+static void render_json( request_rec *r, const dirlimit_snapshot *snap )
 {
-    apr_status_t status = APR_SUCCESS;
-    dirlimit_sconfig *sconf =
-        ap_get_module_config(r->server->module_config, &dirlimit_module);
-    dirlimit_dirconfig *dirconf, *dc;
-    dirconf = ap_get_module_config(r->per_dir_config, &dirlimit_module);
-    size_t pos;
-    int ret;
-    const char *filename, *type;
-    dirlimit_record record;
-    
-    filename = apr_table_get( r->notes, DIRLIMIT_ORIGPATH );
-    if( ! filename ) {
-        DEBUGLOG("pass: filename is not set");
-        return OK;
-    }
-    type = apr_table_get( r->notes, DIRLIMIT_ORIGTYPE );
+    const dirlimit_record *rec;
+    const dirlimit_stat *st;
+    int i, j, n, b, sub;
 
-    status = apr_global_mutex_lock(sconf->mutex);
-    if(status == APR_SUCCESS){
-        DEBUGLOG("global mutex locked(responce_end)");
-    } else {
-        ERRORLOG("mod_dirlimit: global mutex lock faild(responce_end)");
-        (*(sconf->n_lockerror))++;
-        return OK;
+    ap_set_content_type( r, "application/json" );
+    ap_rprintf( r, "{\"total\":%" APR_UINT64_T_FMT ",\"rejected\":%" APR_UINT64_T_FMT
+        ",\"ratelimited\":%" APR_UINT64_T_FMT
+        ",\"lockerror\":%" APR_UINT64_T_FMT ",\"tablefull\":%" APR_UINT64_T_FMT
+        ",\"namefull\":%" APR_UINT64_T_FMT ",\"records_num\":%d,\"records_size\":%d"
+        ",\"clients_num\":%d,\"clients_size\":%d,\"clientfull\":%" APR_UINT64_T_FMT
+        ",\"reclaimed\":%" APR_UINT64_T_FMT ",\"reaped\":%" APR_UINT64_T_FMT
+        ",\"untracked\":%" APR_UINT64_T_FMT ",\"dirs\":[",
+        snap->n_total, snap->n_rejected, snap->n_ratelimited,
+        snap->n_lockerror, snap->n_tablefull, snap->n_namefull,
+        snap->records_num, snap->records_size,
+        snap->clients_num, snap->clients_size, snap->n_clientfull,
+        snap->n_reclaimed, snap->n_reaped, snap->n_ownerfull );
+    for( i=0, n=0; i<snap->slots_num; i++ ) {
+        if( !slot_in_use(i) ) {
+            continue;
+        }
+        ap_rprintf( r, "%s{\"conf_id\":%d,\"path\":\"%s\",\"counter\":%d,\"limit\":%d"
+            ",\"counter_script\":%d,\"limit_script\":%d,\"rejected\":%u"
+            ",\"reclaimed\":%u,\"reclaimed_lease\":%u,\"wait\":{\"depth\":%u,\"max_depth\":%u,\"waited\":%u,\"timeout\":%u"
+            ",\"full\":%u,\"usec\":%" APR_UINT64_T_FMT "}}",
+            n++ ? "," : "", i, json_escape( r->pool, conf_list[i].path ),
+            (int)snap->slots[i].counter, dir_limit( i, &snap->slots[i] ),
+            (int)snap->slots[i].counter_script,
+            limit_in_effect( i, &snap->slots[i], DIRLIMIT_OV_LIMIT_SCRIPT ),
+            snap->slots[i].dir.rejected,
+            snap->slots[i].reclaimed, snap->slots[i].reclaimed_lease,
+            snap->slots[i].waiters, snap->slots[i].wait_max_depth, snap->slots[i].waited,
+            snap->slots[i].wait_timeout, snap->slots[i].wait_full, snap->slots[i].wait_usec );
     }
-    
-    /******* Locked *******/
-    dc = dirconf;
-    while(dc) {
-        record.conf_id = dc->conf_id;
-        /* per-dir */
-        if( dc->limit >= 0  || dc->limit_script >= 0 ) {
-            record.dirname = "";
-            ret = search_record( sconf, &record, &pos );
-            if( !ret ) {
-                ERRORLOG("mod_dirlimit: per-dir record not found(responce_end)");
-            } else {
-                if( type == SCRIPT_TYPE ) {
-                    (sconf->records[pos].counter_script)--;
-                } else {
-                    (sconf->records[pos].counter)--;
-                }
-                if( sconf->records[pos].counter == 0 && sconf->records[pos].counter_script == 0 ) {
-                    remove_record( sconf, pos );
-                } else if( sconf->records[pos].counter < 0 || sconf->records[pos].counter_script < 0 ) {
-                    ERRORLOG("mod_dirlimit: per-dir counter < 0 (responce_end)");
-                }
-            }
+    ap_rputs( "],\"adaptive\":[", r );
+    for( i=0, n=0; i<snap->slots_num; i++ ) {
+        if( !adaptive_in_use(i) ) {
+            continue;
         }
-        /* per-subdir */
-        if( dc->limit_sub >= 0 || dc->limit_sub_script >= 0 ) {
-            record.dirname = get_dirname( r->pool, filename, dc->pathdepth );
-            DEBUGLOG("per-sub dirname %s",record.dirname);
-            ret = search_record( sconf, &record, &pos );
-            if( !ret ) {
-                ERRORLOG("mod_dirlimit: per-subdir record not found(responce_end)");
-            } else {
-                if( type == SCRIPT_TYPE ) {
-                    (sconf->records[pos].counter_script)--;
-                } else {
-                    (sconf->records[pos].counter)--;
-                }
-                if( sconf->records[pos].counter == 0 && sconf->records[pos].counter_script == 0 ) {
-                    remove_record( sconf, pos );
-                } else if( sconf->records[pos].counter < 0 || sconf->records[pos].counter_script < 0 ) {
-                    ERRORLOG("mod_dirlimit: per-dir counter < 0 (responce_end)");
-                }
+        ap_rprintf( r, "%s{\"conf_id\":%d,\"path\":\"%s\",\"min\":%d,\"max\":%d"
+            ",\"limit\":%u,\"up\":%u,\"down\":%u,\"base_usec\":%" APR_UINT64_T_FMT "}",
+            n++ ? "," : "", i, json_escape( r->pool, conf_list[i].path ),
+            conf_list[i].adaptive_min, conf_list[i].adaptive_max,
+            snap->slots[i].limit_eff, snap->slots[i].adapt_up, snap->slots[i].adapt_down,
+            snap->slots[i].adapt_base_usec );
+    }
+    ap_rputs( "],\"overrides\":[", r );
+    for( i=0, n=0; i<snap->slots_num; i++ ) {
+        if( !conf_in_use(i) || !snap->slots[i].overridden ) {
+            continue;
+        }
+        ap_rprintf( r, "%s{\"conf_id\":%d,\"path\":\"%s\",\"limit\":%d,\"limit_script\":%d"
+            ",\"limit_sub\":%d,\"limit_sub_script\":%d,\"since\":%u}",
+            n++ ? "," : "", i, json_escape( r->pool, conf_list[i].path ),
+            limit_in_effect( i, &snap->slots[i], DIRLIMIT_OV_LIMIT ),
+            limit_in_effect( i, &snap->slots[i], DIRLIMIT_OV_LIMIT_SCRIPT ),
+            limit_in_effect( i, &snap->slots[i], DIRLIMIT_OV_SUB ),
+            limit_in_effect( i, &snap->slots[i], DIRLIMIT_OV_SUB_SCRIPT ),
+            snap->slots[i].override_time );
+    }
+    ap_rputs( "],\"reserves\":[", r );
+    for( i=0, n=0; i<snap->slots_num; i++ ) {
+        if( !reserve_in_use(i) ) {
+            continue;
+        }
+        ap_rprintf( r, "%s{\"conf_id\":%d,\"path\":\"%s\",\"taken\":%" APR_UINT64_T_FMT
+            ",\"classes\":[", n++ ? "," : "", i, json_escape( r->pool, conf_list[i].path ),
+            snap->slots[i].reserve_taken );
+        for( j=0; j<conf_list[i].reserves_num; j++ ) {
+            ap_rprintf( r, "%s{\"class\":\"%s\",\"num\":%d,\"used\":%u}",
+                j ? "," : "", json_escape( r->pool, conf_list[i].reserves[j].name ),
+                conf_list[i].reserves[j].num, snap->slots[i].reserved[j] );
+        }
+        ap_rputs( "]}", r );
+    }
+    ap_rputs( "],\"leases\":[", r );
+    for( i=0, n=0; i<snap->slots_num; i++ ) {
+        if( !lease_in_use(i) ) {
+            continue;
+        }
+        ap_rprintf( r, "%s{\"conf_id\":%d,\"path\":\"%s\",\"batch\":%d,\"min_limit\":%d"
+            ",\"refill\":%u,\"return\":%u}",
+            n++ ? "," : "", i, json_escape( r->pool, conf_list[i].path ),
+            conf_list[i].lease, conf_list[i].lease_min,
+            snap->slots[i].lease_refill, snap->slots[i].lease_return );
+    }
+    ap_rputs( "],\"clients\":[", r );
+    for( i=0, n=0; i<snap->slots_num; i++ ) {
+        if( !client_in_use(i) ) {
+            continue;
+        }
+        ap_rprintf( r, "%s{\"conf_id\":%d,\"path\":\"%s\",\"limit\":%d,\"limit_script\":%d"
+            ",\"rejected\":%u}",
+            n++ ? "," : "", i, json_escape( r->pool, conf_list[i].path ),
+            conf_list[i].limit_client, conf_list[i].limit_client_script,
+            snap->slots[i].client.rejected );
+    }
+    ap_rputs( "],\"rates\":[", r );
+    for( i=0, n=0; i<snap->slots_num; i++ ) {
+        if( !rate_in_use(i) ) {
+            continue;
+        }
+        ap_rprintf( r, "%s{\"conf_id\":%d,\"path\":\"%s\",\"rate\":%d,\"burst\":%d"
+            ",\"rejected\":%u,\"rate_sub\":%d,\"burst_sub\":%d,\"rejected_sub\":%u}",
+            n++ ? "," : "", i, json_escape( r->pool, conf_list[i].path ),
+            (int)conf_list[i].rate.rate, (int)conf_list[i].rate.burst,
+            snap->slots[i].dir.rate_rejected,
+            (int)conf_list[i].rate_sub.rate, (int)conf_list[i].rate_sub.burst,
+            snap->slots[i].sub.rate_rejected );
+    }
+    ap_rputs( "],\"bandwidth\":[", r );
+    for( i=0, n=0; i<snap->slots_num; i++ ) {
+        if( !bw_in_use(i) ) {
+            continue;
+        }
+        ap_rprintf( r, "%s{\"conf_id\":%d,\"path\":\"%s\",\"rate\":%" APR_UINT64_T_FMT
+            ",\"rate_script\":%" APR_UINT64_T_FMT ",\"rate_sub\":%" APR_UINT64_T_FMT
+            ",\"rate_sub_script\":%" APR_UINT64_T_FMT ",\"bytes\":%" APR_UINT64_T_FMT
+            ",\"delay_usec\":%" APR_UINT64_T_FMT "}",
+            n++ ? "," : "", i, json_escape( r->pool, conf_list[i].path ),
+            conf_list[i].bw.rate, conf_list[i].bw_script.rate,
+            conf_list[i].bw_sub.rate, conf_list[i].bw_sub_script.rate,
+            snap->slots[i].bw_bytes, snap->slots[i].bw_delay_usec );
+    }
+    ap_rputs( "],\"hold\":[", r );
+    for( i=0, n=0; i<snap->slots_num; i++ ) {
+        if( !conf_in_use(i) ) {
+            continue;
+        }
+        for( sub=0; sub<STAT_KINDS; sub++ ) {
+            st = slot_stat( &snap->slots[i], sub );
+            if( st->accepted == 0 && st->rejected == 0 ) {
+                continue;
+            }
+            ap_rprintf( r, "%s{\"conf_id\":%d,\"scope\":\"%s\",\"accepted\":%u,\"rejected\":%u"
+                ",\"max_counter\":%u,\"hold_usec\":%" APR_UINT64_T_FMT ",\"hist_ms\":[",
+                n++ ? "," : "", i, stat_name[sub], st->accepted, st->rejected,
+                st->max_counter, st->hold_usec );
+            for( b=0; b<HIST_BUCKETS; b++ ) {
+                ap_rprintf( r, "%s%u", b ? "," : "", st->hist[b] );
             }
+            ap_rputs( "]}", r );
         }
-        
-        dc = dc->parent;
     }
-    /************/
-    
-    status = apr_global_mutex_unlock(sconf->mutex);
+    ap_rputs( "],\"subdirs\":[", r );
+    for( i=0; i<snap->records_num; i++ ) {
+        rec = &snap->records[i];
+        ap_rprintf( r, "%s{\"conf_id\":%d,\"path\":\"%s\",\"dirname\":\"%s\",\"counter\":%d"
+            ",\"limit\":%d,\"counter_script\":%d,\"limit_script\":%d,\"rejected\":%u"
+            ",\"accepted\":%u,\"max_counter\":%u}",
+            i ? "," : "", rec->conf_id, json_escape( r->pool, conf_path( rec->conf_id ) ),
+            json_escape( r->pool, record_name( r->pool, snap->names, rec ) ),
+            rec->counter,
+            limit_in_effect( rec->conf_id, &snap->slots[rec->conf_id], DIRLIMIT_OV_SUB ),
+            rec->counter_script,
+            limit_in_effect( rec->conf_id, &snap->slots[rec->conf_id], DIRLIMIT_OV_SUB_SCRIPT ),
+            rec->rejected, rec->accepted, rec->max_counter );
+    }
+    ap_rputs( "]}\n", r );
+}
 
-    DEBUGLOG("global mutex unlocked(responce_end)");
-    return OK;
+/* OpenMetrics label values escape backslash, double quote and newline */
+static const char *label_escape( apr_pool_t *p, const char *str )
+{
+    char *out, *o;
+
+    o = out = apr_palloc( p, strlen(str) * 2 + 1 );
+    for( ; *str; str++ ) {
+        if( *str == '\\' || *str == '"' ) {
+            *o++ = '\\';
+            *o++ = *str;
+        } else if( *str == '\n' ) {
+            *o++ = '\\';
+            *o++ = 'n';
+        } else {
+            *o++ = *str;
+        }
+    }
+    *o = '\0';
+    return out;
 }
 
-static void *create_server_config(apr_pool_t *p, server_rec *s)
+static void metric_family( request_rec *r, const char *name, const char *type, const char *help )
 {
-    dirlimit_sconfig *newcfg = apr_pcalloc(p, sizeof(*newcfg));
-    newcfg->allow_override = 0;
-    newcfg->shm_data = NULL;
-    newcfg->mutex = NULL;
-    newcfg->records_size = 128;
-    
-    DEBUGLOG("create_server_config: %ld at pool %ld\n", (long int)newcfg, (long int)p);
-    return newcfg;
+    ap_rprintf( r, "# TYPE dirlimit_%s %s\n# HELP dirlimit_%s %s\n", name, type, name, help );
 }
 
-static void *create_perdir_config(apr_pool_t *p, char *path)
+/*
+ * Two sections may share a path, the same <Directory> in two vhosts or a
+ * <Directory> and a <Location>, so every scope series carries the conf_id.
+ */
+static const char *scope_labels( apr_pool_t *p, int conf_id )
 {
-    DEBUGLOG("bbbb\n");
-    dirlimit_dirconfig *newcfg = apr_pcalloc(p, sizeof(*newcfg));
-    newcfg->path = path;
-    newcfg->parent = NULL;
-    newcfg->limit = -1;
-    newcfg->limit_sub = -1;
-    newcfg->limit_script = -1;
-    newcfg->limit_sub_script = -1;
-    newcfg->script_types = apr_table_make(p,8);
+    return apr_psprintf( p, "conf_id=\"%d\",path=\"%s\"", conf_id,
+        label_escape( p, conf_path( conf_id ) ) );
+}
+
+/* a record may outlive its scope in the config */
+static const char *record_labels( apr_pool_t *p, const dirlimit_snapshot *snap,
+    const dirlimit_record *rec )
+{
+    return apr_psprintf( p, "%s,sub=\"%s\"", scope_labels( p, rec->conf_id ),
+        label_escape( p, record_name( p, snap->names, rec ) ) );
+}
+
+/* OpenMetrics text for Prometheus, one family after another */
+static void render_metrics( request_rec *r, const dirlimit_snapshot *snap )
+{
+    const dirlimit_record *rec;
+    const dirlimit_stat *st;
+    const char **scopes, *label;
+    apr_uint64_t cum;
+    int i, b, sub, limit, which;
+
+    ap_set_content_type( r, "application/openmetrics-text; version=1.0.0; charset=utf-8" );
+
+    metric_family( r, "requests", "counter", "Requests seen by the limiter." );
+    ap_rprintf( r, "dirlimit_requests_total %" APR_UINT64_T_FMT "\n", snap->n_total );
+    metric_family( r, "rejected", "counter", "Requests rejected by a concurrency limit." );
+    ap_rprintf( r, "dirlimit_rejected_total %" APR_UINT64_T_FMT "\n", snap->n_rejected );
+    metric_family( r, "ratelimited", "counter", "Requests rejected by DirLimitRate." );
+    ap_rprintf( r, "dirlimit_ratelimited_total %" APR_UINT64_T_FMT "\n", snap->n_ratelimited );
+    metric_family( r, "lock_errors", "counter", "Failures to take the global mutex." );
+    ap_rprintf( r, "dirlimit_lock_errors_total %" APR_UINT64_T_FMT "\n", snap->n_lockerror );
+    metric_family( r, "table_full", "counter", "Requests rejected for want of a subdir record." );
+    ap_rprintf( r, "dirlimit_table_full_total %" APR_UINT64_T_FMT "\n", snap->n_tablefull );
+    metric_family( r, "name_full", "counter",
+        "Subdir records keeping only the hash of their name." );
+    ap_rprintf( r, "dirlimit_name_full_total %" APR_UINT64_T_FMT "\n", snap->n_namefull );
+    metric_family( r, "client_table_full", "counter",
+        "Requests admitted without a client entry." );
+    ap_rprintf( r, "dirlimit_client_table_full_total %" APR_UINT64_T_FMT "\n", snap->n_clientfull );
+    metric_family( r, "untracked", "counter",
+        "Requests admitted without an owner entry, not reclaimable." );
+    ap_rprintf( r, "dirlimit_untracked_total %" APR_UINT64_T_FMT "\n", snap->n_ownerfull );
+    metric_family( r, "reaped", "counter", "Owner entries and lease rows of dead children." );
+    ap_rprintf( r, "dirlimit_reaped_total %" APR_UINT64_T_FMT "\n", snap->n_reaped );
+    metric_family( r, "records", "gauge", "Subdir records in use." );
+    ap_rprintf( r, "dirlimit_records %d\n", snap->records_num );
+    metric_family( r, "records_size", "gauge", "DirLimitTableSize." );
+    ap_rprintf( r, "dirlimit_records_size %d\n", snap->records_size );
+    metric_family( r, "clients", "gauge", "Client entries in use." );
+    ap_rprintf( r, "dirlimit_clients %d\n", snap->clients_num );
+    metric_family( r, "clients_size", "gauge", "DirLimitClientTableSize." );
+    ap_rprintf( r, "dirlimit_clients_size %d\n", snap->clients_size );
+
+    scopes = apr_palloc( r->pool, sizeof(char*) * (snap->slots_num > 0 ? snap->slots_num : 1) );
+    for( i=0; i<snap->slots_num; i++ ) {
+        scopes[i] = conf_in_use(i) ? scope_labels( r->pool, i ) : NULL;
+    }
+
+    metric_family( r, "inflight", "gauge", "Requests holding the per-dir counter." );
+    for( i=0; i<snap->slots_num; i++ ) {
+        if( !slot_in_use(i) ) {
+            continue;
+        }
+        ap_rprintf( r, "dirlimit_inflight{%s,type=\"static\"} %u\n"
+            "dirlimit_inflight{%s,type=\"script\"} %u\n",
+            scopes[i], snap->slots[i].counter, scopes[i], snap->slots[i].counter_script );
+    }
+    metric_family( r, "reclaimed", "counter", "Counters given back for dead children." );
+    for( i=0; i<snap->slots_num; i++ ) {
+        if( scopes[i] == NULL ) {
+            continue;
+        }
+        ap_rprintf( r, "dirlimit_reclaimed_total{%s,kind=\"request\"} %u\n"
+            "dirlimit_reclaimed_total{%s,kind=\"lease\"} %u\n",
+            scopes[i], snap->slots[i].reclaimed, scopes[i], snap->slots[i].reclaimed_lease );
+    }
+    metric_family( r, "limit", "gauge", "Limit in effect, per level; absent if unlimited." );
+    for( i=0; i<snap->slots_num; i++ ) {
+        if( scopes[i] == NULL ) {
+            continue;
+        }
+        for( which=0; which<DIRLIMIT_OVERRIDES; which++ ) {
+            if( !( which < DIRLIMIT_OV_SUB ? slot_in_use(i) : sub_in_use(i) ) ||
+                    (limit = limit_in_effect( i, &snap->slots[i], which )) < 0 ) {
+                continue;
+            }
+            ap_rprintf( r, "dirlimit_limit{%s,level=\"%s\",type=\"%s\"} %d\n",
+                scopes[i], which < DIRLIMIT_OV_SUB ? "dir" : "sub",
+                which & 1 ? "script" : "static", limit );
+        }
+        if( conf_list[i].limit_client >= 0 ) {
+            ap_rprintf( r, "dirlimit_limit{%s,level=\"client\",type=\"static\"} %d\n",
+                scopes[i], conf_list[i].limit_client );
+        }
+        if( conf_list[i].limit_client_script >= 0 ) {
+            ap_rprintf( r, "dirlimit_limit{%s,level=\"client\",type=\"script\"} %d\n",
+                scopes[i], conf_list[i].limit_client_script );
+        }
+    }
+
+    metric_family( r, "scope_accepted", "counter", "Requests admitted, per scope and level." );
+    for( i=0; i<snap->slots_num; i++ ) {
+        for( sub=0; scopes[i] && sub<STAT_KINDS; sub++ ) {
+            st = slot_stat( &snap->slots[i], sub );
+            ap_rprintf( r, "dirlimit_scope_accepted_total{%s,level=\"%s\",type=\"static\"} %u\n"
+                "dirlimit_scope_accepted_total{%s,level=\"%s\",type=\"script\"} %u\n",
+                scopes[i], stat_name[sub], st->accepted - st->accepted_script,
+                scopes[i], stat_name[sub], st->accepted_script );
+        }
+    }
+    metric_family( r, "scope_rejected", "counter", "Requests rejected, per scope and level." );
+    for( i=0; i<snap->slots_num; i++ ) {
+        for( sub=0; scopes[i] && sub<STAT_KINDS; sub++ ) {
+            st = slot_stat( &snap->slots[i], sub );
+            ap_rprintf( r, "dirlimit_scope_rejected_total{%s,level=\"%s\",type=\"static\"} %u\n"
+                "dirlimit_scope_rejected_total{%s,level=\"%s\",type=\"script\"} %u\n",
+                scopes[i], stat_name[sub], st->rejected - st->rejected_script,
+                scopes[i], stat_name[sub], st->rejected_script );
+        }
+    }
+    metric_family( r, "scope_ratelimited", "counter", "Requests rejected by DirLimitRate, per scope." );
+    for( i=0; i<snap->slots_num; i++ ) {
+        for( sub=0; scopes[i] && sub<STAT_KINDS; sub++ ) {
+            st = slot_stat( &snap->slots[i], sub );
+            ap_rprintf( r, "dirlimit_scope_ratelimited_total{%s,level=\"%s\"} %u\n",
+                scopes[i], stat_name[sub], st->rate_rejected );
+        }
+    }
+    metric_family( r, "hold_seconds", "histogram", "Time a counter was held." );
+    for( i=0; i<snap->slots_num; i++ ) {
+        for( sub=0; scopes[i] && sub<STAT_KINDS; sub++ ) {
+            st = slot_stat( &snap->slots[i], sub );
+            if( st->accepted == 0 ) {
+                continue;
+            }
+            for( b=0, cum=0; b<HIST_BUCKETS-1; b++ ) {
+                cum += st->hist[b];
+                ap_rprintf( r, "dirlimit_hold_seconds_bucket{%s,level=\"%s\",le=\"%g\"} %"
+                    APR_UINT64_T_FMT "\n", scopes[i], stat_name[sub], (double)(1 << b) / 1000, cum );
+            }
+            cum += st->hist[b];
+            ap_rprintf( r, "dirlimit_hold_seconds_bucket{%s,level=\"%s\",le=\"+Inf\"} %"
+                APR_UINT64_T_FMT "\n", scopes[i], stat_name[sub], cum );
+            ap_rprintf( r, "dirlimit_hold_seconds_count{%s,level=\"%s\"} %"
+                APR_UINT64_T_FMT "\n", scopes[i], stat_name[sub], cum );
+            ap_rprintf( r, "dirlimit_hold_seconds_sum{%s,level=\"%s\"} %.6f\n",
+                scopes[i], stat_name[sub], (double)st->hold_usec / 1000000 );
+        }
+    }
+
+    /* records come and go, so their series do too */
+    metric_family( r, "sub_inflight", "gauge", "Requests holding a subdir record." );
+    for( i=0; i<snap->records_num; i++ ) {
+        rec = &snap->records[i];
+        label = record_labels( r->pool, snap, rec );
+        ap_rprintf( r, "dirlimit_sub_inflight{%s,type=\"static\"} %d\n"
+            "dirlimit_sub_inflight{%s,type=\"script\"} %d\n",
+            label, rec->counter, label, rec->counter_script );
+    }
+    metric_family( r, "sub_accepted", "counter", "Requests admitted by a subdir record." );
+    for( i=0; i<snap->records_num; i++ ) {
+        rec = &snap->records[i];
+        ap_rprintf( r, "dirlimit_sub_accepted_total{%s} %u\n",
+            record_labels( r->pool, snap, rec ), rec->accepted );
+    }
+    metric_family( r, "sub_rejected", "counter", "Requests rejected by a subdir record." );
+    for( i=0; i<snap->records_num; i++ ) {
+        rec = &snap->records[i];
+        ap_rprintf( r, "dirlimit_sub_rejected_total{%s} %u\n",
+            record_labels( r->pool, snap, rec ), rec->rejected );
+    }
+    ap_rputs( "# EOF\n", r );
+}
+
+static int dirlimit_metricshandler(request_rec *r)
+{
+    dirlimit_sconfig *conf =
+        ap_get_module_config(r->server->module_config, &dirlimit_module);
+    dirlimit_snapshot snap;
+
+    if (strcmp(r->handler, "dirlimit-metrics")) {
+        return DECLINED;
+    }
+
+    if( take_snapshot( r->pool, conf, &snap ) != APR_SUCCESS ) {
+        ERRORLOG("mod_dirlimit: global mutex lock faild(metricshandler)");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    r->no_cache = 1;
+    render_metrics( r, &snap );
+    return OK;
+}
+
+#define ADMIN_BODY_MAX              1024
+
+static const char *admin_field[] = { "limit", "limit_script", "limit_sub", "limit_sub_script" };
+
+/* OK with the body in *form, or the status to answer with */
+static int read_form( request_rec *r, char **form )
+{
+    char *buf;
+    apr_size_t len = 0;
+    long n = 0;
+
+    buf = apr_palloc( r->pool, ADMIN_BODY_MAX + 1 );
+    if( ap_setup_client_block( r, REQUEST_CHUNKED_ERROR ) != OK ) {
+        return HTTP_BAD_REQUEST;
+    }
+    /* a cut body would apply only a part of the override */
+    if( r->remaining > ADMIN_BODY_MAX ) {
+        return HTTP_REQUEST_ENTITY_TOO_LARGE;
+    }
+    if( ap_should_client_block( r ) ) {
+        while( len < ADMIN_BODY_MAX &&
+                (n = ap_get_client_block( r, buf + len, ADMIN_BODY_MAX - len )) > 0 ) {
+            len += n;
+        }
+    }
+    if( n < 0 ) {
+        return HTTP_BAD_REQUEST;
+    }
+    buf[len] = '\0';
+    *form = buf;
+    return OK;
+}
+
+/* the whole of val as a decimal number, -1 if it is not one */
+static int parse_num( const char *val, long *num )
+{
+    char *end;
+
+    if( !apr_isdigit(*val) && *val != '-' ) {
+        return -1;
+    }
+    errno = 0;
+    *num = strtol( val, &end, 10 );
+    if( *end != '\0' || errno != 0 || *num < INT_MIN || *num > INT_MAX ) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * conf_id=<id> or path=<scope>, then any of limit, limit_script,
+ * limit_sub and limit_sub_script as a number (-1: unlimited) or "keep"
+ * for the configured one. reset=1 drops every override of the config.
+ */
+static const char *parse_admin( request_rec *r, char *form, int *conf_id, int *limits )
+{
+    dirlimit_sconfig *conf =
+        ap_get_module_config(r->server->module_config, &dirlimit_module);
+    const dirlimit_slot *slot;
+    char *pair, *key, *val, *last;
+    long num;
+    int i, which, set[DIRLIMIT_OVERRIDES], reset = 0;
+
+    *conf_id = -1;
+    for( i=0; i<DIRLIMIT_OVERRIDES; i++ ) {
+        set[i] = 0;
+    }
+    for( pair = apr_strtok( form, "&", &last ); pair; pair = apr_strtok( NULL, "&", &last ) ) {
+        key = pair;
+        if( (val = strchr( pair, '=' )) == NULL ) {
+            return apr_psprintf( r->pool, "No value for %s.", key );
+        }
+        *val++ = '\0';
+        if( ap_unescape_url( val ) != OK ) {
+            return apr_psprintf( r->pool, "Bad escape in %s.", key );
+        }
+        if( strcmp( key, "conf_id" ) == 0 ) {
+            if( parse_num( val, &num ) != 0 || num < 0 || num >= conf_counter ) {
+                return "No such conf_id.";
+            }
+            *conf_id = (int)num;
+            continue;
+        }
+        if( strcmp( key, "path" ) == 0 ) {
+            for( i=0; i<conf_counter; i++ ) {
+                if( conf_list[i].path && strcmp( conf_list[i].path, val ) == 0 ) {
+                    break;
+                }
+            }
+            if( i == conf_counter ) {
+                return "No such path.";
+            }
+            *conf_id = i;
+            continue;
+        }
+        if( strcmp( key, "reset" ) == 0 ) {
+            reset = 1;
+            continue;
+        }
+        for( which=0; which<DIRLIMIT_OVERRIDES; which++ ) {
+            if( strcmp( key, admin_field[which] ) == 0 ) {
+                break;
+            }
+        }
+        if( which == DIRLIMIT_OVERRIDES ) {
+            return apr_psprintf( r->pool, "Unknown field %s.", key );
+        }
+        if( strcmp( val, "keep" ) == 0 ) {
+            limits[which] = DIRLIMIT_KEEP;
+        } else if( parse_num( val, &num ) == 0 && num >= -1 ) {
+            limits[which] = (int)num;
+        } else {
+            return apr_psprintf( r->pool, "Invalid %s (should be num, -1 or keep).", key );
+        }
+        set[which] = 1;
+    }
+    if( *conf_id < 0 ) {
+        return "conf_id or path is required.";
+    }
+    /* a level without a configured limit has no counter to hold it */
+    for( which=0; which<DIRLIMIT_OVERRIDES; which++ ) {
+        if( set[which] && limits[which] != DIRLIMIT_KEEP &&
+                !( which < DIRLIMIT_OV_SUB ? slot_in_use(*conf_id) : sub_in_use(*conf_id) ) ) {
+            return apr_psprintf( r->pool, "%s has no %s level configured.",
+                conf_list[*conf_id].path, which < DIRLIMIT_OV_SUB ? "DirLimit" : "DirLimitPerSub" );
+        }
+    }
+    /* fields not given keep their current override */
+    slot = &conf->eng.slots[*conf_id];
+    for( which=0; which<DIRLIMIT_OVERRIDES; which++ ) {
+        if( reset ) {
+            limits[which] = DIRLIMIT_KEEP;
+        } else if( !set[which] ) {
+            limits[which] = slot->overridden ? slot->override[which] : DIRLIMIT_KEEP;
+        }
+    }
+    return NULL;
+}
+
+/* runtime limits; protect the location with the usual access control */
+static int dirlimit_adminhandler(request_rec *r)
+{
+    dirlimit_sconfig *conf =
+        ap_get_module_config(r->server->module_config, &dirlimit_module);
+    int limits[DIRLIMIT_OVERRIDES];
+    const char *err;
+    char *form;
+    int conf_id, which, status;
+
+    if (strcmp(r->handler, "dirlimit-admin")) {
+        return DECLINED;
+    }
+    r->allowed = AP_METHOD_BIT << M_POST;
+    if( r->method_number != M_POST ) {
+        return HTTP_METHOD_NOT_ALLOWED;
+    }
+    if( (status = read_form( r, &form )) != OK ) {
+        return status;
+    }
+
+    r->no_cache = 1;
+    ap_set_content_type( r, "text/plain" );
+    if( (err = parse_admin( r, form, &conf_id, limits )) != NULL ) {
+        r->status = HTTP_BAD_REQUEST;
+        ap_rprintf( r, "%s\n", err );
+        return OK;
+    }
+    /* writers of the override serialize on the mutex, readers never take it */
+    if( dirlimit_lock( &conf->eng ) != APR_SUCCESS ) {
+        ERRORLOG("mod_dirlimit: global mutex lock faild(adminhandler)");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    dirlimit_set_override( &conf->eng, conf_id, limits );
+    dirlimit_unlock( &conf->eng );
+
+    ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, NULL,
+        "mod_dirlimit: conf %d %s limits set to %d %d %d %d (-2: as configured) by %s",
+        conf_id, conf_list[conf_id].path, limits[0], limits[1], limits[2], limits[3],
+#ifdef APACHE24
+        r->useragent_ip );
+#else
+        r->connection->remote_ip );
+#endif
+    for( which=0; which<DIRLIMIT_OVERRIDES; which++ ) {
+        ap_rprintf( r, "%s: %d%s\n", admin_field[which],
+            limit_in_effect( conf_id, &conf->eng.slots[conf_id], which ),
+            limits[which] == DIRLIMIT_KEEP ? "" : " (override)" );
+    }
+    return OK;
+}
+
+static int dirlimit_statushandler(request_rec *r)
+{
+    dirlimit_sconfig *conf =
+        ap_get_module_config(r->server->module_config, &dirlimit_module);
+    dirlimit_snapshot snap;
+
+    if (strcmp(r->handler, "dirlimit-status")) {
+        return DECLINED;
+    }
+
+    if( take_snapshot( r->pool, conf, &snap ) != APR_SUCCESS ) {
+        ERRORLOG("mod_dirlimit: global mutex lock faild(statushandler)");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* no lock is held while writing to the client */
+    r->no_cache = 1;
+    if( r->args && strcasecmp( r->args, "json" ) == 0 ) {
+        render_json( r, &snap );
+    } else if( r->args && strcasecmp( r->args, "auto" ) == 0 ) {
+        render_auto( r, &snap );
+    } else {
+        render_text( r, &snap );
+    }
+    return OK;
+}
+
+
+/* the component at pathdepth, in place; *len is its length */
+static inline const char *get_dirname( const char *path, int pathdepth, int *len )
+{
+    static const char unknown[] = "!!nuknown dir!!";
+    int i=0;
+    const char *p = path;
+    if( *p == '/' ) {
+        p++;
+    }
+    for(i=0; i<pathdepth; p++ ) {
+        if( *p == '/' ) {
+            i++;
+        } else if( *p == '\0' ) {
+            *len = sizeof(unknown) - 1;
+            return unknown;
+        }
+    }
+    for( i=0; p[i] != '/' && p[i] != '\0'; i++ ) {
+    }
+    *len = i;
+    return p;
+}
+
+static inline int get_pathdepth( const char *path )
+{
+    int i,l,c=0;
+    const char *p = path;
+    if( p[0] == '/' ) {
+        p++;
+    }
+    l = strlen(p) - 1;
+    if( l > 0 ) {
+        c++;
+    }
+    for( i=0; i<l; i++ ) {
+        if( p[i] == '/' ) {
+            c++;
+        }
+    }
+    return c;
+}
+
+
+static inline int has_dir_limit( const dirlimit_dirconfig *dc )
+{
+    return dc->limit >= 0 || dc->limit_script >= 0 || dc->adaptive_max > 0;
+}
+
+static inline int has_sub_limit( const dirlimit_dirconfig *dc )
+{
+    return dc->limit_sub >= 0 || dc->limit_sub_script >= 0;
+}
+
+static inline int has_dir_bandwidth( const dirlimit_dirconfig *dc )
+{
+    return dc->bw.rate > 0 || dc->bw_script.rate > 0;
+}
+
+/* the bucket lives in the subdir record, which the request has to hold */
+static inline int has_sub_bandwidth( const dirlimit_dirconfig *dc )
+{
+    return dc->bw_sub.rate > 0 || dc->bw_sub_script.rate > 0;
+}
+
+static inline int has_client_limit( const dirlimit_dirconfig *dc )
+{
+    return dc->limit_client >= 0 || dc->limit_client_script >= 0;
+}
+
+static inline int has_rate( const dirlimit_dirconfig *dc )
+{
+    return dc->rate.rate > 0 || dc->rate_sub.rate > 0;
+}
+
+static dirlimit_chain *compile_chain( apr_pool_t *p, const dirlimit_dirconfig *dirconf )
+{
+    const dirlimit_dirconfig *dc;
+    const apr_array_header_t *arr;
+    const apr_table_entry_t *elts;
+    dirlimit_chain *chain;
+    dirlimit_level *lv;
+    int i, j, n, ntypes;
+
+    n = 0;
+    ntypes = 0;
+    for( dc = dirconf; dc; dc = dc->parent ) {
+        if( has_dir_limit(dc) || has_sub_limit(dc) || has_client_limit(dc) ||
+                has_dir_bandwidth(dc) || has_sub_bandwidth(dc) || has_rate(dc) ) {
+            n++;
+        }
+        ntypes += apr_table_elts(dc->script_types)->nelts;
+    }
+
+    chain = apr_pcalloc( p, sizeof(*chain) );
+    for( dc = dirconf; dc; dc = dc->parent ) {
+        if( dc->wait_ms >= 0 ) {
+            chain->wait_ms = dc->wait_ms;
+            chain->wait_queue = dc->wait_queue;
+            break;
+        }
+    }
+    chain->release = RELEASE_LOG;
+    for( dc = dirconf; dc; dc = dc->parent ) {
+        if( dc->release != RELEASE_UNSET ) {
+            chain->release = dc->release;
+            break;
+        }
+    }
+    chain->levels = apr_pcalloc( p, sizeof(dirlimit_level) * (n > 0 ? n : 1) );
+    chain->types = apr_pcalloc( p, sizeof(dirlimit_typemap) * (ntypes > 0 ? ntypes : 1) );
+
+    for( dc = dirconf; dc; dc = dc->parent ) {
+        /* the nearest DirLimitSet(No)ScriptType wins */
+        arr = apr_table_elts(dc->script_types);
+        elts = (const apr_table_entry_t*)arr->elts;
+        for( i=0; i<arr->nelts; i++ ) {
+            for( j=0; j<chain->types_num; j++ ) {
+                if( strcasecmp( chain->types[j].handler, elts[i].key ) == 0 ) {
+                    break;
+                }
+            }
+            if( j == chain->types_num ) {
+                chain->types[j].handler = elts[i].key;
+                chain->types[j].type = elts[i].val;
+                chain->types_num++;
+            }
+        }
+
+        if( !has_dir_limit(dc) && !has_sub_limit(dc) && !has_client_limit(dc) &&
+                !has_dir_bandwidth(dc) && !has_sub_bandwidth(dc) && !has_rate(dc) ) {
+            continue;
+        }
+        lv = &chain->levels[chain->levels_num++];
+        lv->conf_id = dc->conf_id;
+        lv->flags = 0;
+        if( has_dir_limit(dc) ) {
+            lv->flags |= LEVEL_DIR;
+        }
+        if( has_sub_limit(dc) || has_sub_bandwidth(dc) || dc->rate_sub.rate > 0 ) {
+            lv->flags |= LEVEL_SUB;
+            chain->need_lock = 1;
+        }
+        if( has_client_limit(dc) ) {
+            lv->flags |= LEVEL_CLIENT;
+            chain->need_lock = 1;
+            chain->has_client = 1;
+        }
+        if( has_rate(dc) ) {
+            chain->has_rate = 1;
+        }
+        if( has_dir_bandwidth(dc) || has_sub_bandwidth(dc) ) {
+            chain->has_bw = 1;
+        }
+        lv->limit = dc->limit;
+        lv->limit_script = dc->limit_script;
+        lv->limit_sub = dc->limit_sub;
+        lv->limit_sub_script = dc->limit_sub_script;
+        lv->pathdepth = dc->pathdepth;
+        lv->bw = dc->bw;
+        lv->bw_script = dc->bw_script;
+        lv->bw_sub = dc->bw_sub;
+        lv->bw_sub_script = dc->bw_sub_script;
+        lv->lease = dc->lease;
+        lv->lease_min = dc->lease_min;
+        lv->adaptive = dc->adaptive_max;
+        for( j=0; j<dc->reserves_num; j++ ) {
+            lv->reserve[j] = dc->reserves[j].num;
+            lv->reserve_total += dc->reserves[j].num;
+        }
+        if( lv->reserve_total > 0 ) {
+            chain->has_reserve = 1;
+        }
+        lv->limit_client = dc->limit_client;
+        lv->limit_client_script = dc->limit_client_script;
+        lv->rate = dc->rate;
+        lv->rate_sub = dc->rate_sub;
+    }
+    return chain;
+}
+
+/* the miss path of get_chain(), once per distinct chain and child */
+static dirlimit_chain *cache_chain( dirlimit_dirconfig *head, const dirlimit_dirconfig **key,
+    int n, const dirlimit_dirconfig *dirconf )
+{
+    dirlimit_cached_chain *c;
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock( chain_mutex );
+#endif
+    for( c = head->chains; c; c = c->next ) {
+        if( c->depth == n && memcmp( c->origins, key, sizeof(*key) * n ) == 0 ) {
+            break;
+        }
+    }
+    if( c == NULL ) {
+        c = apr_palloc( chain_pool, sizeof(*c) );
+        c->depth = n;
+        c->origins = apr_pmemdup( chain_pool, key, sizeof(*key) * n );
+        c->chain = compile_chain( chain_pool, dirconf );
+        c->next = head->chains;
+        /* readers walk the list without the mutex */
+        __sync_synchronize();
+        head->chains = c;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock( chain_mutex );
+#endif
+    return c->chain;
+}
+
+/*
+ * httpd merges the configs on every request, but a merged config differs
+ * from the ones it was made of only in its parents, so the chain is
+ * compiled once per child for each sequence of origins.
+ */
+static dirlimit_chain *get_chain( request_rec *r, const dirlimit_dirconfig *dirconf )
+{
+    const dirlimit_dirconfig *key[CHAIN_DEPTH_MAX], *dc;
+    dirlimit_dirconfig *head = (dirlimit_dirconfig*)dirconf->origin;
+    dirlimit_cached_chain *c;
+    int n = 0;
+
+    for( dc = dirconf; dc; dc = dc->parent ) {
+        /* .htaccess configs are made anew for each request */
+        if( n == CHAIN_DEPTH_MAX || dc->transient || chain_pool == NULL ) {
+            return compile_chain( r->pool, dirconf );
+        }
+        key[n++] = dc->origin;
+    }
+    for( c = head->chains; c; c = c->next ) {
+        if( c->depth == n && memcmp( c->origins, key, sizeof(*key) * n ) == 0 ) {
+            return c->chain;
+        }
+    }
+    return cache_chain( head, key, n, dirconf );
+}
+
+/* the DirLimitReserve class of the request in a scope, -1: none */
+static int match_class( request_rec *r, const dirlimit_dirconfig *dc )
+{
+    const dirlimit_class *c;
+    int k;
+
+    for( k=0; k<dc->reserves_num; k++ ) {
+        c = &dc->reserves[k];
+        if( c->kind == CLASS_METHOD ) {
+            if( c->methods & (AP_METHOD_BIT << r->method_number) ) {
+                return k;
+            }
+        } else if( c->kind == CLASS_ENV ) {
+            if( apr_table_get( r->subprocess_env, c->env ) ) {
+                return k;
+            }
+#ifdef APACHE24
+        } else if( apr_ipsubnet_test( c->net, r->useragent_addr ) ) {
+#else
+        } else if( apr_ipsubnet_test( c->net, r->connection->remote_addr ) ) {
+#endif
+            return k;
+        }
+    }
+    return -1;
+}
+
+static inline const char *get_script_type( const dirlimit_chain *chain, const char *handler )
+{
+    int i;
+    if( handler == NULL ) {
+        return NULL;
+    }
+    for( i=0; i<chain->types_num; i++ ) {
+        if( strcasecmp( chain->types[i].handler, handler ) == 0 ) {
+            return chain->types[i].type;
+        }
+    }
+    return NULL;
+}
+
+
+/* a token bucket the response is charged to */
+typedef struct {
+    int conf_id;
+    dirlimit_handle *h;         /* per-subdir record, NULL: per-dir slot */
+    const dirlimit_gcra *bw;
+} dirlimit_shaper;
+
+typedef struct {
+    dirlimit_reqconfig *rc;
+    int shapers_num;
+    dirlimit_shaper *shapers;
+    apr_off_t chunk;
+    int release;                /* release the counters at EOS (DirLimitRelease handler) */
+    apr_bucket_brigade *tmp;
+} dirlimit_bwctx;
+
+static inline void add_shaper( dirlimit_bwctx *ctx, int conf_id, dirlimit_handle *h,
+    const dirlimit_gcra *bw )
+{
+    dirlimit_shaper *sh = &ctx->shapers[ctx->shapers_num++];
+    apr_off_t chunk;
+
+    sh->conf_id = conf_id;
+    sh->h = h;
+    sh->bw = bw;
+    chunk = bw->rate / 10;
+    if( chunk < BW_CHUNK_MIN ) {
+        chunk = BW_CHUNK_MIN;
+    }
+    if( chunk < ctx->chunk ) {
+        ctx->chunk = chunk;
+    }
+}
+
+/*
+ * Insert the bandwidth filter for the buckets of the chain.
+ * Returns 1 if it also took over a DirLimitRelease handler release.
+ */
+static int add_bandwidth_filter( request_rec *r, const dirlimit_chain *chain,
+    dirlimit_reqconfig *rc )
+{
+    const dirlimit_level *lv;
+    const dirlimit_gcra *bw;
+    dirlimit_bwctx *ctx;
+    int i, n, has_sub = 0;
+
+    ctx = apr_pcalloc( r->pool, sizeof(*ctx) );
+    ctx->rc = rc;
+    ctx->shapers = apr_palloc( r->pool, sizeof(dirlimit_shaper) * chain->levels_num * 2 );
+    ctx->chunk = BW_CHUNK_MAX;
+    /* n follows the handles in the order dirlimit_acquire() took them */
+    for( i=0, n=0; i<chain->levels_num; i++ ) {
+        lv = &chain->levels[i];
+        if( lv->flags & LEVEL_DIR ) {
+            n++;
+        }
+        bw = (rc->type == SCRIPT_TYPE) ? &lv->bw_script : &lv->bw;
+        if( bw->rate > 0 ) {
+            add_shaper( ctx, lv->conf_id, NULL, bw );
+        }
+        if( lv->flags & LEVEL_SUB ) {
+            bw = (rc->type == SCRIPT_TYPE) ? &lv->bw_sub_script : &lv->bw_sub;
+            if( bw->rate > 0 ) {
+                add_shaper( ctx, lv->conf_id, &rc->handles[n], bw );
+                has_sub = 1;
+            }
+            n++;
+        }
+    }
+    if( ctx->shapers_num == 0 ) {
+        return 0;
+    }
+    /*
+     * Releasing in a resource filter would drop the subdir records before
+     * the body is through, so the bandwidth filter releases at EOS instead.
+     */
+    ctx->release = has_sub && chain->release == RELEASE_HANDLER;
+    ap_add_output_filter( BANDWIDTH_FILTER, ctx, r, r->connection );
+    return ctx->release;
+}
+
+/* the DirLimitWait queue the request is in, for dirlimit_reap(); -1: none */
+static inline void set_waiting( dirlimit_reqconfig *rc, int conf_id )
+{
+    if( rc->owner ) {
+        rc->owner->waiting = conf_id + 1;
+    }
+}
+
+static int dirlimit_check_limit(request_rec *r)
+{
+    dirlimit_sconfig *sconf =
+        ap_get_module_config(r->server->module_config, &dirlimit_module);
+    dirlimit_dirconfig *dirconf;
+    dirconf = ap_get_module_config(r->per_dir_config, &dirlimit_module);
+    const dirlimit_chain *chain;
+    const dirlimit_level *lv;
+    dirlimit_reqconfig *rc;
+    dirlimit_key *keys;
+    int *classes;
+    int i, ret, fail, fail_kind, wait_conf, deferred;
+    apr_uint32_t seq = 0;
+    apr_time_t start = 0, now, deadline = 0;
+    apr_interval_time_t retry;
+    const char *type;
+    
+    /* is sub request ? */
+    if( r->main || r->prev ) {
+        DEBUGLOG("pass: it is sub request %s", r->filename);
+        return OK;
+    }
+    
+    DEBUGLOG("fixup: %s", r->filename );
+
+    ATOMIC_INC64(&sconf->eng.shm->n_total);
+    
+    chain = get_chain( r, dirconf );
+    if( chain->levels_num == 0 ) {
+        return OK;
+    }
+    type = get_script_type( chain, r->handler );
+
+    rc = apr_pcalloc( r->pool, sizeof(*rc) );
+    rc->type = type;
+    rc->need_lock = chain->need_lock;
+    /* in the segment, so that the parent can give them back if we die */
+    rc->owner = dirlimit_owner_claim( &sconf->eng, chain->levels_num * 3 );
+    rc->handles = rc->owner ? rc->owner->handles :
+        apr_palloc( r->pool, sizeof(dirlimit_handle) * chain->levels_num * 3 );
+    if( chain->has_client ) {
+#ifdef APACHE24
+        rc->client_hash = dirlimit_hash_client( r->useragent_ip );
+#else
+        rc->client_hash = dirlimit_hash_client( r->connection->remote_ip );
+#endif
+    }
+
+    keys = apr_palloc( r->pool, sizeof(dirlimit_key) * chain->levels_num );
+    for( i=0; i<chain->levels_num; i++ ) {
+        lv = &chain->levels[i];
+        if( lv->flags & LEVEL_SUB ) {
+            keys[i].conf_id = lv->conf_id;
+            keys[i].dirname = get_dirname( r->filename, lv->pathdepth, &keys[i].dirname_len );
+            keys[i].hash = dirlimit_hash_record( keys[i].conf_id, keys[i].dirname,
+                keys[i].dirname_len );
+            DEBUGLOG("per-sub dirname %.*s", keys[i].dirname_len, keys[i].dirname);
+        }
+    }
+    if( chain->has_reserve ) {
+        classes = apr_palloc( r->pool, sizeof(int) * chain->levels_num );
+        for( i=0; i<chain->levels_num; i++ ) {
+            lv = &chain->levels[i];
+            classes[i] = lv->reserve_total > 0 ? match_class( r, &conf_list[lv->conf_id] ) : -1;
+        }
+        rc->classes = classes;
+    }
+
+    /*
+     * With DirLimitWait, a rejected request queues on the config that
+     * rejected it and retries whenever a counter there is released.
+     */
+    wait_conf = -1;
+    for(;;) {
+        if( wait_conf >= 0 ) {
+            seq = apr_atomic_read32(&sconf->eng.slots[wait_conf].wake_seq);
+        }
+        ret = dirlimit_acquire( &sconf->eng, chain, keys, type, chain->wait_ms <= 0,
+            rc, &fail, &fail_kind, &retry );
+        /* a rate rejection does not wait for a release */
+        if( ret != DIRLIMIT_REJECTED || chain->wait_ms <= 0 || retry > 0 ) {
+            break;
+        }
+        now = apr_time_now();
+        if( wait_conf < 0 ) {
+            start = now;
+            deadline = now + apr_time_from_msec(chain->wait_ms);
+        }
+        if( wait_conf != chain->levels[fail].conf_id ) {
+            if( wait_conf >= 0 ) {
+                set_waiting( rc, -1 );
+                dirlimit_leave_queue( &sconf->eng, wait_conf );
+            }
+            wait_conf = chain->levels[fail].conf_id;
+            if( dirlimit_enter_queue( &sconf->eng, wait_conf, chain->wait_queue ) < 0 ) {
+                wait_conf = -1;
+                dirlimit_count_rejection( &sconf->eng, chain->levels[fail].conf_id, fail_kind,
+                    type );
+                break;
+            }
+            set_waiting( rc, wait_conf );
+            /* retry once with the sequence read before the attempt */
+            continue;
+        }
+        if( now >= deadline ) {
+            apr_atomic_inc32(&sconf->eng.slots[wait_conf].wait_timeout);
+            dirlimit_count_rejection( &sconf->eng, wait_conf, fail_kind, type );
+            break;
+        }
+        dirlimit_wait( &sconf->eng, wait_conf, seq, deadline - now );
+    }
+    if( wait_conf >= 0 ) {
+        ATOMIC_ADD64( &sconf->eng.slots[wait_conf].wait_usec, (uint64_t)(apr_time_now() - start) );
+        set_waiting( rc, -1 );
+        dirlimit_leave_queue( &sconf->eng, wait_conf );
+    }
+    if( ret != DIRLIMIT_OK && rc->owner ) {
+        dirlimit_owner_free( &sconf->eng, rc->owner );
+        rc->owner = NULL;
+    }
+    if( ret == DIRLIMIT_LOCKERROR ) {
+        ERRORLOG("mod_dirlimit: global mutex lock faild(check_limit)");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    if( ret != DIRLIMIT_OK ) {
+        if( retry > 0 ) {
+            apr_table_setn( r->err_headers_out, "Retry-After", apr_psprintf( r->pool, "%d",
+                (int)((retry + APR_USEC_PER_SEC - 1) / APR_USEC_PER_SEC) ) );
+        }
+        return HTTP_SERVICE_UNAVAILABLE;
+    }
+    
+    rc->acquired = apr_time_now();
+    ap_set_module_config( r->request_config, &dirlimit_module, rc );
+    /* added first, so that it runs before the EOS release filter */
+    deferred = chain->has_bw ? add_bandwidth_filter( r, chain, rc ) : 0;
+    if( chain->release == RELEASE_HANDLER && !deferred ) {
+        ap_add_output_filter( RELEASE_HANDLER_FILTER, rc, r, r->connection );
+    } else if( chain->release == RELEASE_EOS ) {
+        ap_add_output_filter( RELEASE_EOS_FILTER, rc, r, r->connection );
+    }
+    
+    return OK;
+}
+
+static void release_request( dirlimit_sconfig *sconf, dirlimit_reqconfig *rc )
+{
+    int err;
+
+    if( rc->released ) {
+        return;
+    }
+    rc->released = 1;
+
+    err = dirlimit_release( &sconf->eng, rc, apr_time_now() - rc->acquired );
+    /* on a lock error the parent gives back what is left in the owner entry */
+    if( rc->owner && err != DIRLIMIT_LOCKERROR ) {
+        dirlimit_owner_free( &sconf->eng, rc->owner );
+        rc->owner = NULL;
+    }
+    if( err == DIRLIMIT_LOCKERROR ) {
+        ERRORLOG("mod_dirlimit: global mutex lock faild(responce_end)");
+    } else if( err ) {
+        ERRORLOG("mod_dirlimit: %d counter(s) not found or below zero(responce_end)", err);
+    }
+}
+
+/*
+ * DirLimitRelease handler|eos: release on EOS, before passing it on
+ * (handler) or once it has been handed to the connection filters (eos).
+ * log_transaction still releases when EOS never comes through, e.g. on
+ * error responses which bypass the resource filters.
+ */
+static apr_status_t release_filter( ap_filter_t *f, apr_bucket_brigade *bb, int after )
+{
+    dirlimit_sconfig *sconf =
+        ap_get_module_config(f->r->server->module_config, &dirlimit_module);
+    dirlimit_reqconfig *rc = f->ctx;
+    apr_status_t rv;
+    apr_bucket *e;
+
+    for( e = APR_BRIGADE_FIRST(bb); e != APR_BRIGADE_SENTINEL(bb); e = APR_BUCKET_NEXT(e) ) {
+        if( APR_BUCKET_IS_EOS(e) ) {
+            break;
+        }
+    }
+    if( e == APR_BRIGADE_SENTINEL(bb) ) {
+        return ap_pass_brigade( f->next, bb );
+    }
+    ap_remove_output_filter(f);
+    if( !after ) {
+        release_request( sconf, rc );
+        return ap_pass_brigade( f->next, bb );
+    }
+    rv = ap_pass_brigade( f->next, bb );
+    release_request( sconf, rc );
+    return rv;
+}
+
+static apr_status_t dirlimit_release_handler_filter( ap_filter_t *f, apr_bucket_brigade *bb )
+{
+    return release_filter( f, bb, 0 );
+}
+
+static apr_status_t dirlimit_release_eos_filter( ap_filter_t *f, apr_bucket_brigade *bb )
+{
+    return release_filter( f, bb, 1 );
+}
+
+
+/* DirLimitBandwidth: pass the response in chunks, sleeping as the buckets say */
+static apr_status_t dirlimit_bandwidth_filter( ap_filter_t *f, apr_bucket_brigade *bb )
+{
+    dirlimit_sconfig *sconf =
+        ap_get_module_config(f->r->server->module_config, &dirlimit_module);
+    dirlimit_bwctx *ctx = f->ctx;
+    dirlimit_shaper *sh;
+    volatile uint64_t *tat;
+    apr_interval_time_t wait, w;
+    apr_bucket *e;
+    apr_off_t len;
+    apr_status_t rv;
+    uint64_t now;
+    int i, eos, wait_conf;
+
+    if( ctx->tmp == NULL ) {
+        ctx->tmp = apr_brigade_create( f->r->pool, f->c->bucket_alloc );
+    }
+    while( !APR_BRIGADE_EMPTY(bb) ) {
+        rv = apr_brigade_partition( bb, ctx->chunk, &e );
+        if( rv != APR_SUCCESS && rv != APR_INCOMPLETE ) {
+            return rv;
+        }
+        apr_brigade_split_ex( bb, e, ctx->tmp );
+        rv = apr_brigade_length( bb, 1, &len );
+        if( rv != APR_SUCCESS ) {
+            return rv;
+        }
+        eos = 0;
+        for( e = APR_BRIGADE_FIRST(bb); e != APR_BRIGADE_SENTINEL(bb); e = APR_BUCKET_NEXT(e) ) {
+            if( APR_BUCKET_IS_EOS(e) ) {
+                eos = 1;
+            }
+        }
+
+        wait = 0;
+        wait_conf = -1;
+        now = (uint64_t)apr_time_now() * 1000;
+        for( i=0; len > 0 && i<ctx->shapers_num; i++ ) {
+            sh = &ctx->shapers[i];
+            if( sh->h == NULL ) {
+                tat = (ctx->rc->type == SCRIPT_TYPE) ? &sconf->eng.slots[sh->conf_id].bw_tat_script
+                    : &sconf->eng.slots[sh->conf_id].bw_tat;
+                ATOMIC_ADD64(&sconf->eng.slots[sh->conf_id].bw_bytes, (uint64_t)len);
+            } else if( ctx->rc->released ) {
+                /* the record is no longer ours */
+                continue;
+            } else {
+                tat = dirlimit_record_bucket( &sconf->eng, sh->h, ctx->rc->type );
+                if( tat == NULL ) {
+                    continue;
+                }
+            }
+            w = dirlimit_charge( tat, sh->bw, now, len );
+            if( w > wait ) {
+                wait = w;
+                wait_conf = sh->conf_id;
+            }
+        }
+        if( wait > 0 ) {
+            ATOMIC_ADD64(&sconf->eng.slots[wait_conf].bw_delay_usec, (uint64_t)wait);
+            apr_sleep( wait );
+        }
+
+        if( eos && ctx->release ) {
+            release_request( sconf, ctx->rc );
+        }
+        rv = ap_pass_brigade( f->next, bb );
+        apr_brigade_cleanup( bb );
+        if( rv != APR_SUCCESS ) {
+            apr_brigade_cleanup( ctx->tmp );
+            return rv;
+        }
+        APR_BRIGADE_CONCAT( bb, ctx->tmp );
+    }
+    return APR_SUCCESS;
+}
+
+static int dirlimit_response_end(request_rec *r)
+{
+    dirlimit_sconfig *sconf =
+        ap_get_module_config(r->server->module_config, &dirlimit_module);
+    dirlimit_reqconfig *rc;
+    
+    /* counters are held by the initial request of an internal redirect */
+    while( r->prev ) {
+        r = r->prev;
+    }
+    rc = ap_get_module_config( r->request_config, &dirlimit_module );
+    if( rc == NULL ) {
+        DEBUGLOG("pass: no counter taken");
+        return OK;
+    }
+    release_request( sconf, rc );
+    return OK;
+}
+
+static void *create_server_config(apr_pool_t *p, server_rec *s)
+{
+    dirlimit_sconfig *newcfg = apr_pcalloc(p, sizeof(*newcfg));
+    newcfg->allow_override = 0;
+    newcfg->shm_data = NULL;
+    newcfg->eng.mutex = NULL;
+    newcfg->records_size = 128;
+    newcfg->clients_size = 256;
+    newcfg->log_interval = 10;
     
-    if( post_config_flag || conf_counter >= MAX_CONFIGS ) {
-        newcfg->conf_id = -1;
+    DEBUGLOG("create_server_config: %ld at pool %ld\n", (long int)newcfg, (long int)p);
+    return newcfg;
+}
+
+/*
+ * A scope is named by its path and how many scopes of the same path came
+ * before it, so it finds its slot of the previous generation again.
+ * A new scope takes a slot free there, or else one past the old segment;
+ * post_config() makes a larger one then.  Only scopes with a DirLimit
+ * directive are given a conf_id.
+ */
+static void claim_conf_id( apr_pool_t *p, dirlimit_dirconfig *dirconf )
+{
+    const char *name = dirconf->path ? dirconf->path : "null";
+    int *nth, *id;
+
+    if( post_config_flag || dirconf->conf_id >= 0 ) {
+        return;
+    }
+    nth = apr_hash_get( ident_seen, name, APR_HASH_KEY_STRING );
+    if( nth == NULL ) {
+        nth = apr_pcalloc( p, sizeof(*nth) );
+        apr_hash_set( ident_seen, apr_pstrdup( p, name ), APR_HASH_KEY_STRING, nth );
+    }
+    /* the path and its occurrence, so that a reload finds the same section */
+    dirconf->ident = dirlimit_hash_ident( apr_psprintf( p, "%s#%d", name, (*nth)++ ) );
+    id = apr_hash_get( prev_ids, &dirconf->ident, sizeof(dirconf->ident) );
+    if( id ) {
+        apr_hash_set( prev_ids, &dirconf->ident, sizeof(dirconf->ident), NULL );
+        dirconf->conf_id = *id;
+    } else if( prev_free->nelts > 0 ) {
+        dirconf->conf_id = *(int*)apr_array_pop( prev_free );
     } else {
-        newcfg->conf_id = conf_counter++;
+        dirconf->conf_id = prev_slots++;
     }
+    if( dirconf->conf_id >= conf_counter ) {
+        conf_counter = dirconf->conf_id + 1;
+    }
+    *(dirlimit_dirconfig**)apr_array_push( conf_reg ) = dirconf;
+}
+
+static void *create_perdir_config(apr_pool_t *p, char *path)
+{
+    DEBUGLOG("bbbb\n");
+    dirlimit_dirconfig *newcfg = apr_pcalloc(p, sizeof(*newcfg));
+    newcfg->path = path;
+    newcfg->parent = NULL;
+    newcfg->limit = -1;
+    newcfg->limit_sub = -1;
+    newcfg->limit_script = -1;
+    newcfg->limit_sub_script = -1;
+    newcfg->limit_client = -1;
+    newcfg->limit_client_script = -1;
+    newcfg->wait_ms = -1;
+    newcfg->script_types = apr_table_make(p,8);
+    newcfg->conf_id = -1;
+    newcfg->origin = newcfg;
+    newcfg->transient = post_config_flag;
     DEBUGLOG("create_perdir_config: %s %ld at pool %ld\n", path, (long int)newcfg, (long int)p);
     return newcfg;
 }
@@ -603,7 +2063,6 @@ static void *merge_perdir_config(apr_pool_t *p, void *basev, void *overridev)
         root_copy->parent = base;
         child->parent = root_copy;
     }
-    
     return new;
 }
 
@@ -638,101 +2097,348 @@ static int get_cmd_context(cmd_parms *cmd)
             return CONTEXT_LOCATION_MATCH;
         }
     }
-    return CONTEXT_OTHERS;
+    return CONTEXT_OTHERS;
+}
+
+const char *str_context(int c)
+{
+    if( c == CONTEXT_DIRECTORY ) {
+        return "CONTEXT_DIRECTORY";
+    } else if( c == CONTEXT_DIRECTORY_MATCH ) {
+        return "CONTEXT_DIRECTORY_MATCH";
+    } else if( c == CONTEXT_FILES ) {
+        return "CONTEXT_FILES";
+    } else if( c == CONTEXT_FILES_MATCH ) {
+        return "CONTEXT_FILES_MATCH";
+    } else if( c == CONTEXT_LOCATION ) {
+        return "CONTEXT_LOCATION";
+    } else if( c == CONTEXT_LOCATION_MATCH ) {
+        return "CONTEXT_LOCATION_MATCH";
+    } else {
+        return "CONTEXT_OTHERS";
+    }
+}
+
+static const char *set_limit(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    dirlimit_dirconfig *dirconf = (dirlimit_dirconfig*)dummy;
+    int limit;
+    limit = atoi(arg);
+    if( limit < 0 ) {
+        return "Invalid limit (should be positive num).";
+    }
+    dirconf->limit = limit;
+    claim_conf_id( cmd->pool, dirconf );
+    return NULL;
+}
+
+static const char *set_limit_sub(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    dirlimit_dirconfig *dirconf = (dirlimit_dirconfig*)dummy;
+    int limit;
+    limit = atoi(arg);
+    if( limit < 0 ) {
+        return "Invalid limit (should be positive num).";
+    }
+    dirconf->cmd_context = get_cmd_context(cmd);
+    if( dirconf->cmd_context == CONTEXT_DIRECTORY || dirconf->cmd_context == CONTEXT_LOCATION ) {
+        dirconf->pathdepth = get_pathdepth(dirconf->path);
+    } else {
+        return "Per-subdirectory limit is allowd in only <Directory> or <Location>.";
+    }
+    dirconf->limit_sub = limit;
+    claim_conf_id( cmd->pool, dirconf );
+    return NULL;
+}
+
+static const char *set_limit_script(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    dirlimit_dirconfig *dirconf = (dirlimit_dirconfig*)dummy;
+    int limit;
+    limit = atoi(arg);
+    if( limit < 0 ) {
+        return "Invalid limit (should be positive num).";
+    }
+    dirconf->limit_script = limit;
+    claim_conf_id( cmd->pool, dirconf );
+    return NULL;
+}
+
+static const char *set_limit_script_sub(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    dirlimit_dirconfig *dirconf = (dirlimit_dirconfig*)dummy;
+    int limit;
+    limit = atoi(arg);
+    if( limit < 0 ) {
+        return "Invalid limit (should be positive num).";
+    }
+    dirconf->cmd_context = get_cmd_context(cmd);
+    if( dirconf->cmd_context == CONTEXT_DIRECTORY || dirconf->cmd_context == CONTEXT_LOCATION ) {
+        dirconf->pathdepth = get_pathdepth(dirconf->path);
+    } else {
+        return "Per-subdirectory limit is allowed in only <Directory> or <Location>.";
+    }
+    dirconf->limit_sub_script = limit;
+    claim_conf_id( cmd->pool, dirconf );
+    return NULL;
+}
+
+static const char *set_limit_client(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    dirlimit_dirconfig *dirconf = (dirlimit_dirconfig*)dummy;
+    int limit;
+    limit = atoi(arg);
+    if( limit < 0 ) {
+        return "Invalid limit (should be positive num).";
+    }
+    dirconf->limit_client = limit;
+    claim_conf_id( cmd->pool, dirconf );
+    return NULL;
+}
+
+static const char *set_limit_script_client(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    dirlimit_dirconfig *dirconf = (dirlimit_dirconfig*)dummy;
+    int limit;
+    limit = atoi(arg);
+    if( limit < 0 ) {
+        return "Invalid limit (should be positive num).";
+    }
+    dirconf->limit_client_script = limit;
+    claim_conf_id( cmd->pool, dirconf );
+    return NULL;
+}
+
+static const char *set_adaptive(cmd_parms *cmd, void *dummy, const char *arg1, const char *arg2)
+{
+    dirlimit_dirconfig *dirconf = (dirlimit_dirconfig*)dummy;
+    int min, max;
+    min = atoi(arg1);
+    max = atoi(arg2);
+    if( min <= 0 || max < min ) {
+        return "Invalid adaptive limits (should be 0 < min <= max).";
+    }
+    dirconf->adaptive_min = min;
+    dirconf->adaptive_max = max;
+    claim_conf_id( cmd->pool, dirconf );
+    return NULL;
+}
+
+/* method=GET,HEAD env=name net=addr[/mask] */
+static const char *parse_class( apr_pool_t *p, dirlimit_class *c, const char *arg )
+{
+    char *val, *tok, *last, *mask;
+    int m;
+
+    c->name = arg;
+    if( strncasecmp( arg, "method=", 7 ) == 0 ) {
+        c->kind = CLASS_METHOD;
+        val = apr_pstrdup( p, arg + 7 );
+        for( tok = apr_strtok( val, ",", &last ); tok; tok = apr_strtok( NULL, ",", &last ) ) {
+            m = ap_method_number_of( tok );
+            if( m == M_INVALID ) {
+                return apr_pstrcat( p, "Unknown method: ", tok, NULL );
+            }
+            c->methods |= AP_METHOD_BIT << m;
+        }
+        return c->methods ? NULL : "No method given.";
+    }
+    if( strncasecmp( arg, "env=", 4 ) == 0 && arg[4] ) {
+        c->kind = CLASS_ENV;
+        c->env = arg + 4;
+        return NULL;
+    }
+    if( strncasecmp( arg, "net=", 4 ) == 0 ) {
+        c->kind = CLASS_NET;
+        val = apr_pstrdup( p, arg + 4 );
+        if( (mask = strchr( val, '/' )) != NULL ) {
+            *mask++ = '\0';
+        }
+        if( apr_ipsubnet_create( &c->net, val, mask, p ) != APR_SUCCESS ) {
+            return apr_pstrcat( p, "Invalid network: ", arg + 4, NULL );
+        }
+        return NULL;
+    }
+    return "Invalid class (should be method=..., env=... or net=...).";
+}
+
+static const char *set_reserve(cmd_parms *cmd, void *dummy, const char *arg1, const char *arg2)
+{
+    dirlimit_dirconfig *dirconf = (dirlimit_dirconfig*)dummy;
+    dirlimit_class c;
+    const char *err;
+    memset( &c, 0, sizeof(c) );
+    if( (err = parse_class( cmd->pool, &c, arg1 )) != NULL ) {
+        return err;
+    }
+    c.num = atoi(arg2);
+    if( c.num <= 0 ) {
+        return "Invalid reserve (should be positive num).";
+    }
+    if( dirconf->reserves_num >= DIRLIMIT_CLASSES ) {
+        return "Too many reserves in a scope.";
+    }
+    dirconf->reserves[ dirconf->reserves_num++ ] = c;
+    claim_conf_id( cmd->pool, dirconf );
+    return NULL;
 }
 
-const char *str_context(int c)
+static const char *set_lease(cmd_parms *cmd, void *dummy, const char *arg1, const char *arg2)
 {
-    if( c == CONTEXT_DIRECTORY ) {
-        return "CONTEXT_DIRECTORY";
-    } else if( c == CONTEXT_DIRECTORY_MATCH ) {
-        return "CONTEXT_DIRECTORY_MATCH";
-    } else if( c == CONTEXT_FILES ) {
-        return "CONTEXT_FILES";
-    } else if( c == CONTEXT_FILES_MATCH ) {
-        return "CONTEXT_FILES_MATCH";
-    } else if( c == CONTEXT_LOCATION ) {
-        return "CONTEXT_LOCATION";
-    } else if( c == CONTEXT_LOCATION_MATCH ) {
-        return "CONTEXT_LOCATION_MATCH";
-    } else {
-        return "CONTEXT_OTHERS";
+    dirlimit_dirconfig *dirconf = (dirlimit_dirconfig*)dummy;
+    int batch, min;
+    batch = atoi(arg1);
+    if( batch <= 0 ) {
+        return "Invalid lease batch (should be positive num).";
+    }
+    min = batch * 8;
+    if( arg2 ) {
+        min = atoi(arg2);
+        if( min < 0 ) {
+            return "Invalid minimum limit (should be positive num).";
+        }
     }
+    dirconf->lease = batch;
+    dirconf->lease_min = min;
+    claim_conf_id( cmd->pool, dirconf );
+    return NULL;
 }
 
-static const char *set_limit(cmd_parms *cmd, void *dummy, const char *arg)
+/* <per sec> [burst] */
+static const char *parse_gcra( dirlimit_gcra *bw, const char *arg1, const char *arg2 )
 {
-    dirlimit_dirconfig *dirconf = (dirlimit_dirconfig*)dummy;
-    int limit;
-    limit = atoi(arg);
-    if( limit < 0 ) {
-        return "Invalid limit (should be positive num).";
+    apr_int64_t rate, burst = 0;
+    rate = apr_atoi64(arg1);
+    if( rate <= 0 ) {
+        return "Invalid rate (should be positive num).";
     }
-    if( ! post_config_flag && dirconf->conf_id < 0 ) {
-        return "Too many configs.";
+    if( arg2 ) {
+        burst = apr_atoi64(arg2);
+        if( burst < 0 ) {
+            return "Invalid burst (should be positive num).";
+        }
     }
-    dirconf->limit = limit;
-    conf_list[ dirconf->conf_id ] = *dirconf;
+    bw->rate = rate;
+    bw->burst = burst;
+    bw->tau = (apr_uint64_t)burst * 1000000000 / rate;
     return NULL;
 }
 
-static const char *set_limit_sub(cmd_parms *cmd, void *dummy, const char *arg)
+static const char *set_bandwidth(cmd_parms *cmd, void *dummy, const char *arg1, const char *arg2)
 {
     dirlimit_dirconfig *dirconf = (dirlimit_dirconfig*)dummy;
-    int limit;
-    limit = atoi(arg);
-    if( limit < 0 ) {
-        return "Invalid limit (should be positive num).";
+    const char *err;
+    if( (err = parse_gcra( &dirconf->bw, arg1, arg2 )) != NULL ) {
+        return err;
     }
-    if( ! post_config_flag && dirconf->conf_id < 0 ) {
-        return "Too many configs.";
+    claim_conf_id( cmd->pool, dirconf );
+    return NULL;
+}
+
+static const char *set_bandwidth_script(cmd_parms *cmd, void *dummy, const char *arg1, const char *arg2)
+{
+    dirlimit_dirconfig *dirconf = (dirlimit_dirconfig*)dummy;
+    const char *err;
+    if( (err = parse_gcra( &dirconf->bw_script, arg1, arg2 )) != NULL ) {
+        return err;
     }
+    claim_conf_id( cmd->pool, dirconf );
+    return NULL;
+}
+
+static const char *set_bandwidth_sub(cmd_parms *cmd, void *dummy, const char *arg1, const char *arg2)
+{
+    dirlimit_dirconfig *dirconf = (dirlimit_dirconfig*)dummy;
+    const char *err;
     dirconf->cmd_context = get_cmd_context(cmd);
     if( dirconf->cmd_context == CONTEXT_DIRECTORY || dirconf->cmd_context == CONTEXT_LOCATION ) {
         dirconf->pathdepth = get_pathdepth(dirconf->path);
     } else {
-        return "Per-subdirectory limit is allowd in only <Directory> or <Location>.";
+        return "Per-subdirectory limit is allowed in only <Directory> or <Location>.";
     }
-    dirconf->limit_sub = limit;
-    conf_list[ dirconf->conf_id ] = *dirconf;
+    if( (err = parse_gcra( &dirconf->bw_sub, arg1, arg2 )) != NULL ) {
+        return err;
+    }
+    claim_conf_id( cmd->pool, dirconf );
     return NULL;
 }
 
-static const char *set_limit_script(cmd_parms *cmd, void *dummy, const char *arg)
+static const char *set_bandwidth_script_sub(cmd_parms *cmd, void *dummy, const char *arg1, const char *arg2)
 {
     dirlimit_dirconfig *dirconf = (dirlimit_dirconfig*)dummy;
-    int limit;
-    limit = atoi(arg);
-    if( limit < 0 ) {
-        return "Invalid limit (should be positive num).";
+    const char *err;
+    dirconf->cmd_context = get_cmd_context(cmd);
+    if( dirconf->cmd_context == CONTEXT_DIRECTORY || dirconf->cmd_context == CONTEXT_LOCATION ) {
+        dirconf->pathdepth = get_pathdepth(dirconf->path);
+    } else {
+        return "Per-subdirectory limit is allowed in only <Directory> or <Location>.";
     }
-    if( ! post_config_flag && dirconf->conf_id < 0 ) {
-        return "Too many configs.";
+    if( (err = parse_gcra( &dirconf->bw_sub_script, arg1, arg2 )) != NULL ) {
+        return err;
     }
-    dirconf->limit_script = limit;
-    conf_list[ dirconf->conf_id ] = *dirconf;
+    claim_conf_id( cmd->pool, dirconf );
     return NULL;
 }
 
-static const char *set_limit_script_sub(cmd_parms *cmd, void *dummy, const char *arg)
+static const char *set_rate(cmd_parms *cmd, void *dummy, const char *arg1, const char *arg2)
 {
     dirlimit_dirconfig *dirconf = (dirlimit_dirconfig*)dummy;
-    int limit;
-    limit = atoi(arg);
-    if( limit < 0 ) {
-        return "Invalid limit (should be positive num).";
-    }
-    if( ! post_config_flag && dirconf->conf_id < 0 ) {
-        return "Too many configs.";
+    const char *err;
+    if( (err = parse_gcra( &dirconf->rate, arg1, arg2 )) != NULL ) {
+        return err;
     }
+    claim_conf_id( cmd->pool, dirconf );
+    return NULL;
+}
+
+static const char *set_rate_sub(cmd_parms *cmd, void *dummy, const char *arg1, const char *arg2)
+{
+    dirlimit_dirconfig *dirconf = (dirlimit_dirconfig*)dummy;
+    const char *err;
     dirconf->cmd_context = get_cmd_context(cmd);
     if( dirconf->cmd_context == CONTEXT_DIRECTORY || dirconf->cmd_context == CONTEXT_LOCATION ) {
         dirconf->pathdepth = get_pathdepth(dirconf->path);
     } else {
         return "Per-subdirectory limit is allowed in only <Directory> or <Location>.";
     }
-    dirconf->limit_sub_script = limit;
-    conf_list[ dirconf->conf_id ] = *dirconf;
+    if( (err = parse_gcra( &dirconf->rate_sub, arg1, arg2 )) != NULL ) {
+        return err;
+    }
+    claim_conf_id( cmd->pool, dirconf );
+    return NULL;
+}
+
+static const char *set_wait(cmd_parms *cmd, void *dummy, const char *arg1, const char *arg2)
+{
+    dirlimit_dirconfig *dirconf = (dirlimit_dirconfig*)dummy;
+    int ms, queue = 0;
+    ms = atoi(arg1);
+    if( ms < 0 ) {
+        return "Invalid wait time (should be positive num).";
+    }
+    if( arg2 ) {
+        queue = atoi(arg2);
+        if( queue < 0 ) {
+            return "Invalid queue size (should be positive num).";
+        }
+    }
+    dirconf->wait_ms = ms;
+    dirconf->wait_queue = queue;
+    return NULL;
+}
+
+static const char *set_release(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    dirlimit_dirconfig *dirconf = (dirlimit_dirconfig*)dummy;
+    if( strcasecmp( arg, "log" ) == 0 ) {
+        dirconf->release = RELEASE_LOG;
+    } else if( strcasecmp( arg, "handler" ) == 0 ) {
+        dirconf->release = RELEASE_HANDLER;
+    } else if( strcasecmp( arg, "eos" ) == 0 ) {
+        dirconf->release = RELEASE_EOS;
+    } else {
+        return "DirLimitRelease must be one of handler, eos or log.";
+    }
     return NULL;
 }
 
@@ -763,12 +2469,299 @@ static const char *set_table_size(cmd_parms *cmd, void *dummy, const char *arg)
     return NULL;
 }
 
+static const char *set_shm_file(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    dirlimit_sconfig *conf =
+        ap_get_module_config(cmd->server->module_config, &dirlimit_module);
+    conf->shm_file = ap_server_root_relative( cmd->pool, arg );
+    if( conf->shm_file == NULL ) {
+        return apr_pstrcat( cmd->pool, "Invalid shm file path: ", arg, NULL );
+    }
+    return NULL;
+}
+
+static const char *set_client_table_size(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    dirlimit_sconfig *conf =
+        ap_get_module_config(cmd->server->module_config, &dirlimit_module);
+    int size = atoi(arg);
+    if( size < 16 ) {
+        return "Invalid table size (should be >= 16).";
+    }
+    conf->clients_size = size;
+    return NULL;
+}
+
+static const char *set_log_interval(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    dirlimit_sconfig *conf =
+        ap_get_module_config(cmd->server->module_config, &dirlimit_module);
+    int sec = atoi(arg);
+    if( sec < 0 ) {
+        return "Invalid interval (should be >= 0).";
+    }
+    conf->log_interval = sec;
+    return NULL;
+}
+
+/* conf_ids are given while parsing, against the segment kept from the last run */
+static int pre_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp)
+{
+    dirlimit_persist *persist;
+    dirlimit_engine prev_eng;
+    uint64_t *ident;
+    int *id, i;
+    void *data;
+
+    post_config_flag = 0;
+    conf_counter = 0;
+    conf_reg = apr_array_make( pconf, 64, sizeof(dirlimit_dirconfig*) );
+    conf_list = NULL;
+    conf_size = 0;
+    ident_seen = apr_hash_make( pconf );
+    prev_ids = apr_hash_make( pconf );
+    prev_free = apr_array_make( pconf, 16, sizeof(int) );
+    prev_slots = 0;
+
+    apr_pool_userdata_get( &data, PERSIST_KEY, ap_pglobal );
+    persist = data;
+    if( persist == NULL || persist->shm == NULL ||
+            dirlimit_check_layout( apr_shm_baseaddr_get(persist->shm) ) != 0 ) {
+        return OK;
+    }
+    dirlimit_engine_attach( &prev_eng, apr_shm_baseaddr_get(persist->shm) );
+    prev_slots = prev_eng.shm->slots_num;
+    for( i=prev_slots - 1; i>=0; i-- ) {
+        if( prev_eng.slots[i].ident == 0 ) {
+            *(int*)apr_array_push( prev_free ) = i;
+            continue;
+        }
+        ident = apr_palloc( pconf, sizeof(*ident) );
+        id = apr_palloc( pconf, sizeof(*id) );
+        *ident = prev_eng.slots[i].ident;
+        *id = i;
+        apr_hash_set( prev_ids, ident, sizeof(*ident), id );
+    }
+    return OK;
+}
+
+/* the main server keeps PERSIST_KEY, a vhost adds its name and port */
+static dirlimit_persist *get_persist( apr_pool_t *ptemp, apr_hash_t *seen, server_rec *s, int is_main )
+{
+    dirlimit_persist *persist;
+    const char *key;
+    apr_status_t status;
+    void *data;
+    int *nth;
+
+    if( is_main ) {
+        key = PERSIST_KEY;
+    } else {
+        key = apr_psprintf( ptemp, "%s:%s:%u", PERSIST_KEY,
+            s->server_hostname ? s->server_hostname : "", (unsigned)s->port );
+        nth = apr_hash_get( seen, key, APR_HASH_KEY_STRING );
+        if( nth == NULL ) {
+            nth = apr_pcalloc( ptemp, sizeof(*nth) );
+            apr_hash_set( seen, key, APR_HASH_KEY_STRING, nth );
+        }
+        if( (*nth)++ > 0 ) {
+            key = apr_psprintf( ptemp, "%s#%d", key, *nth );
+        }
+    }
+    apr_pool_userdata_get( &data, key, ap_pglobal );
+    if( data ) {
+        return data;
+    }
+
+    persist = apr_pcalloc( ap_pglobal, sizeof(*persist) );
+    //Create global mutex, shared by all generations of the segment
+    status = apr_global_mutex_create(&(persist->mutex), MUTEX_PATH, APR_LOCK_DEFAULT, ap_pglobal);
+    if(status != APR_SUCCESS) {
+        ERRORLOG("mod_dirlimit: create gloval mutex faild");
+        return NULL;
+    }
+#ifdef AP_NEED_SET_MUTEX_PERMS
+    status = unixd_set_global_mutex_perms(persist->mutex);
+    if(status != APR_SUCCESS) {
+       ERRORLOG("mod_dirlimit: Parent could not set permissions on globalmutex");
+        return NULL;
+    }
+#endif
+    apr_pool_userdata_set( persist, key, apr_pool_cleanup_null, ap_pglobal );
+    return persist;
+}
+
+static inline int same_file( const char *a, const char *b )
+{
+    return a == NULL ? b == NULL : b != NULL && strcmp( a, b ) == 0;
+}
+
+/*
+ * Keep the segment of the previous generation if its tables fit the new
+ * config. Old children still release into it, so a slot goes to another
+ * scope only when idle; else the old children keep it and we start anew.
+ */
+static int adopt_segment( dirlimit_sconfig *conf, dirlimit_persist *persist,
+    int procs_num, int owners_num )
+{
+    dirlimit_engine *eng = &conf->eng;
+    dirlimit_shm_header *shm;
+    dirlimit_slot *slot;
+    static const int keep[DIRLIMIT_OVERRIDES] = {
+        DIRLIMIT_KEEP, DIRLIMIT_KEEP, DIRLIMIT_KEEP, DIRLIMIT_KEEP };
+    uint64_t ident;
+    int i, ok = 1;
+
+    if( persist->shm == NULL ) {
+        return 0;
+    }
+    shm = apr_shm_baseaddr_get( persist->shm );
+    if( dirlimit_check_layout( shm ) != 0 || (int)shm->slots_num < conf_counter ||
+            shm->records_size != conf->records_size || shm->clients_size != conf->clients_size ||
+            shm->procs_num != procs_num || shm->owners_num != owners_num ||
+            ! same_file( persist->shm_file, conf->shm_file ) ) {
+        return 0;
+    }
+    dirlimit_engine_attach( eng, shm );
+    if( dirlimit_lock( eng ) != APR_SUCCESS ) {
+        return 0;
+    }
+    for( i=0; i<conf_counter; i++ ) {
+        slot = &eng->slots[i];
+        if( conf_list[i].ident && slot->ident && slot->ident != conf_list[i].ident &&
+                ! dirlimit_conf_idle( eng, i ) ) {
+            ok = 0;
+            break;
+        }
+    }
+    for( i=0; ok && i<(int)shm->slots_num; i++ ) {
+        slot = &eng->slots[i];
+        ident = i < conf_counter ? conf_list[i].ident : 0;
+        /* a scope taking the slot, or one gone whose requests are done */
+        if( slot->ident != ident && (ident || dirlimit_conf_idle( eng, i )) ) {
+            if( slot->ident ) {
+                dirlimit_reset_conf( eng, i );
+            }
+            slot->ident = ident;
+            slot->generation = persist->generation;
+        }
+        slot->claimed = ident != 0;
+        /* dirlimit-admin overrides end with the generation */
+        if( slot->overridden ) {
+            dirlimit_set_override( eng, i, keep );
+        }
+    }
+    if( ok ) {
+        shm->generation = persist->generation;
+    }
+    dirlimit_unlock( eng );
+    return ok;
+}
+
+static int create_segment( apr_pool_t *p, dirlimit_sconfig *conf, dirlimit_persist *persist,
+    int procs_num, int owners_num )
+{
+    apr_status_t status;
+    size_t shm_size, retsize;
+    int i, slots_num;
+
+    /* children of the old generation keep their own mapping */
+    if( persist->shm ) {
+        apr_shm_destroy( persist->shm );
+        persist->shm = NULL;
+    }
+
+    //Remove existing shared memory
+    if( conf->shm_file ) {
+        status = apr_shm_remove(conf->shm_file, p);
+        if (status == APR_SUCCESS) {
+            ERRORLOG("mod_dirlimit: removed existing shared memory file");
+        }
+    }
+
+    //Create shared memory, with spare slots for scopes added by a later restart
+    slots_num = conf_counter + conf_counter / 4 + 16;
+    shm_size = dirlimit_engine_size( slots_num, conf->records_size, conf->clients_size,
+        procs_num, owners_num );
+    status = apr_shm_create(&(persist->shm), shm_size, conf->shm_file, ap_pglobal);
+    if(status != APR_SUCCESS) {
+        ERRORLOG("mod_dirlimit: failed to create shared memory");
+        return -1;
+    }
+    
+    retsize = apr_shm_size_get(persist->shm);
+    if( retsize != shm_size ) {
+        ERRORLOG("mod_dirlimit: ivalid shared memory size");
+        return -1;
+    }
+    persist->shm_file = conf->shm_file ? apr_pstrdup( ap_pglobal, conf->shm_file ) : NULL;
+
+    dirlimit_engine_init( &conf->eng, apr_shm_baseaddr_get(persist->shm),
+        slots_num, conf->records_size, conf->clients_size, procs_num, owners_num );
+    conf->eng.shm->generation = persist->generation;
+    for( i=0; i<conf_counter; i++ ) {
+        conf->eng.slots[i].ident = conf_list[i].ident;
+        conf->eng.slots[i].claimed = conf_list[i].ident != 0;
+    }
+    for( i=0; i<slots_num; i++ ) {
+        conf->eng.slots[i].generation = persist->generation;
+    }
+    return 0;
+}
+
+/* conf_list by conf_id, grown to cover the slots of a kept segment */
+static void size_conf_list( apr_pool_t *p, int size )
+{
+    dirlimit_dirconfig *list;
+    dirlimit_dirconfig **reg = (dirlimit_dirconfig**)conf_reg->elts;
+    int i;
+
+    if( conf_list && size <= conf_size ) {
+        return;
+    }
+    list = apr_pcalloc( p, sizeof(*list) * (size > 0 ? size : 1) );
+    if( conf_list ) {
+        memcpy( list, conf_list, sizeof(*list) * conf_size );
+    } else {
+        for( i=0; i<conf_reg->nelts; i++ ) {
+            list[ reg[i]->conf_id ] = *reg[i];
+        }
+    }
+    conf_list = list;
+    conf_size = size;
+}
+
+/* an owner entry per worker thread, a lease row per child if DirLimitLease is used */
+static void owner_sizes( int *procs_num, int *owners_num )
+{
+    int daemons = 0, threads = 0, i;
+
+    ap_mpm_query( AP_MPMQ_HARD_LIMIT_DAEMONS, &daemons );
+    ap_mpm_query( AP_MPMQ_HARD_LIMIT_THREADS, &threads );
+    if( daemons < 1 ) {
+        daemons = 1;
+    }
+    if( threads < 1 ) {
+        threads = 1;
+    }
+    *owners_num = daemons * threads;
+    *procs_num = 0;
+    for( i=0; i<conf_counter; i++ ) {
+        if( conf_list[i].lease > 0 ) {
+            *procs_num = daemons;
+            break;
+        }
+    }
+}
+
 static int post_config(apr_pool_t *p, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s)
 {
     dirlimit_sconfig *conf;
+    dirlimit_persist *persist;
+    server_rec *s_main = s;
+    apr_hash_t *seen;
     void *user_data;
-    apr_status_t status;
-    size_t shm_size, retsize, i;
+    int i, procs_num, owners_num;
 
     apr_pool_userdata_get(&user_data, USER_DATA_KEY, s->process->pool);
     if(user_data == NULL) {
@@ -776,77 +2769,211 @@ static int post_config(apr_pool_t *p, apr_pool_t *plog, apr_pool_t *ptemp, serve
         return OK;
     }
 
+    size_conf_list( p, conf_counter );
+    seen = apr_hash_make( ptemp );
+    owner_sizes( &procs_num, &owners_num );
     do{
         conf = (dirlimit_sconfig*)(ap_get_module_config(s->module_config, &dirlimit_module));
-        //Create global mutex
-        status = apr_global_mutex_create(&(conf->mutex), MUTEX_PATH, APR_LOCK_DEFAULT, p);
-        if(status != APR_SUCCESS) {
-            ERRORLOG("mod_dirlimit: create gloval mutex faild");
-            return HTTP_INTERNAL_SERVER_ERROR;
-        }
-#ifdef AP_NEED_SET_MUTEX_PERMS
-        status = unixd_set_global_mutex_perms(conf->mutex);
-        if(status != APR_SUCCESS) {
-           ERRORLOG("mod_dirlimit: Parent could not set permissions on globalmutex");
+        persist = get_persist( ptemp, seen, s, s == s_main );
+        if( persist == NULL ) {
             return HTTP_INTERNAL_SERVER_ERROR;
         }
-#endif
-
-        //Remove existing shared memory
-        status = apr_shm_remove(SHM_PATH, p);
-        if (status == APR_SUCCESS) {
-            ERRORLOG("mod_dirlimit: removed existing shared memory file");
-        }
+        conf->eng.mutex = persist->mutex;
+        persist->generation++;
 
-        //Create shared memory
-        shm_size = MAX_DIRNAME * conf->records_size +
-                sizeof(dirlimit_record) * conf->records_size + sizeof(uint64_t)*3;
-        status = apr_shm_create(&(conf->shm_data), shm_size, SHM_PATH, p);
-        if(status != APR_SUCCESS) {
-            ERRORLOG("mod_dirlimit: failed to create shared memory");
-            return HTTP_INTERNAL_SERVER_ERROR;
-        }
-        
-        retsize = apr_shm_size_get(conf->shm_data);
-        if( retsize != shm_size ) {
-            ERRORLOG("mod_dirlimit: ivalid shared memory size");
+        if( adopt_segment( conf, persist, procs_num, owners_num ) ) {
+            ap_log_error(APLOG_MARK, APLOG_INFO, 0, s,
+                "mod_dirlimit: kept shared memory, generation %u", persist->generation);
+        } else if( create_segment( p, conf, persist, procs_num, owners_num ) != 0 ) {
             return HTTP_INTERNAL_SERVER_ERROR;
         }
-
-        conf->shm_data = apr_shm_baseaddr_get(conf->shm_data);
-        conf->strdata = (char*)conf->shm_data;
-        conf->records = (dirlimit_record*)&(conf->strdata[MAX_DIRNAME*conf->records_size]);
-        conf->records_num = (size_t*)&conf->records[conf->records_size];
-        conf->n_total = (uint64_t*)(conf->records_num + 1);
-        conf->n_rejected = conf->n_total + 1;
-        conf->n_lockerror = conf->n_total + 2;
-        DEBUGLOG("conf->shm_data: %lX \nconf->strdata: %lX \nconf->records: %lX \nconf->records_num: %lX \n",
-            (long int)conf->shm_data, (long int)conf->strdata, (long int)conf->records, (long int)conf->records_num );
+        conf->shm_data = persist->shm;
+        size_conf_list( p, conf->eng.shm->slots_num );
+        DEBUGLOG("conf->shm: %lX \nconf->slots: %lX \nconf->records: %lX \n",
+            (long int)conf->eng.shm, (long int)conf->eng.slots, (long int)conf->eng.records );
         
-        for( i=0; i<conf->records_size; i++ ) {
-            conf->records[i].dirname = &(conf->strdata[i*MAX_DIRNAME]);
-            conf->records[i].dirname[0] = '\0';
+        for( i=0; i<(int)conf->eng.shm->slots_num; i++ ) {
+            dirlimit_set_adaptive( &conf->eng, i,
+                conf_list[i].adaptive_min, conf_list[i].adaptive_max );
         }
-        *(conf->records_num) = 0;
-        
-        *(conf->n_total) = 0;
-        *(conf->n_rejected) = 0;
-        *(conf->n_lockerror) = 0;
+        conf->last_report = apr_time_now();
+        conf->tablefull_reported = conf->eng.shm->n_tablefull;
         DEBUGLOG("mod_dirlimit: init");
     } while( (s=s->next) != NULL );
     
     post_config_flag = 1;
+#ifndef APACHE24
+    main_server = s_main;
+#endif
 
     return OK;
 }
 
+typedef struct {
+    apr_uint32_t n;
+    dirlimit_record rec;        /* name_off into the copied names */
+} dirlimit_reject_entry;
+
+/*
+ * Runs in the parent. Under the mutex the records are only copied into
+ * memory taken before it, nothing is allocated or logged.
+ */
+static void report_rejections( apr_pool_t *p, dirlimit_sconfig *conf, int elapsed )
+{
+    dirlimit_slot *slot;
+    dirlimit_record *rec;
+    dirlimit_reject_entry *entries;
+    apr_uint32_t cur, n, n_sub, n_client, sub_total = 0, used = 0;
+    uint64_t tablefull;
+    const char *path;
+    char *names;
+    int i, num;
+
+    for( i=0; i<conf->eng.shm->slots_num; i++ ) {
+        slot = &conf->eng.slots[i];
+        cur = apr_atomic_read32(&slot->dir.rejected);
+        n = cur - slot->dir.rejected_reported;
+        slot->dir.rejected_reported = cur;
+        cur = apr_atomic_read32(&slot->sub.rejected);
+        n_sub = cur - slot->sub.rejected_reported;
+        slot->sub.rejected_reported = cur;
+        sub_total += n_sub;
+        cur = apr_atomic_read32(&slot->client.rejected);
+        n_client = cur - slot->client.rejected_reported;
+        slot->client.rejected_reported = cur;
+        path = conf_path( i );
+        if( n > 0 ) {
+            ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, NULL,
+                "mod_dirlimit: conf %d %s rejected %u in last %ds", i, path, n, elapsed);
+        }
+        if( n_sub > 0 ) {
+            ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, NULL,
+                "mod_dirlimit: conf %d %s (per-subdir) rejected %u in last %ds",
+                i, path, n_sub, elapsed);
+        }
+        if( n_client > 0 ) {
+            ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, NULL,
+                "mod_dirlimit: conf %d %s (per-client) rejected %u in last %ds",
+                i, path, n_client, elapsed);
+        }
+    }
+
+    tablefull = conf->eng.shm->n_tablefull;
+    if( tablefull != conf->tablefull_reported ) {
+        ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, NULL,
+            "mod_dirlimit: table full (DirLimitTableSize %d) rejected %d in last %ds",
+            (int)conf->eng.shm->records_size, (int)(tablefull - conf->tablefull_reported), elapsed);
+        conf->tablefull_reported = tablefull;
+    }
+
+    /* a record rejects only along with the per-subdir count of its scope */
+    if( sub_total == 0 ) {
+        return;
+    }
+    entries = apr_palloc( p, sizeof(*entries) * conf->eng.shm->records_size );
+    names = apr_palloc( p, conf->eng.shm->names_size );
+    if( dirlimit_lock( &conf->eng ) != APR_SUCCESS ) {
+        return;
+    }
+    num = 0;
+    for( i=0; i<conf->eng.shm->table_size && num<conf->eng.shm->records_size; i++ ) {
+        rec = &conf->eng.records[i];
+        if( rec->conf_id < 0 || rec->rejected == rec->rejected_reported ) {
+            continue;
+        }
+        entries[num].n = rec->rejected - rec->rejected_reported;
+        entries[num].rec = *rec;
+        /* the names fit, each one takes at least its length + 1 in the arena */
+        if( rec->name_off != DIRLIMIT_NO_NAME ) {
+            memcpy( names + used, conf->eng.names + rec->name_off, rec->name_len + 1 );
+            entries[num].rec.name_off = used;
+            used += rec->name_len + 1;
+        }
+        rec->rejected_reported = rec->rejected;
+        num++;
+    }
+    dirlimit_unlock( &conf->eng );
+
+    for( i=0; i<num; i++ ) {
+        rec = &entries[i].rec;
+        path = conf_path( rec->conf_id );
+        ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, NULL,
+            "mod_dirlimit: conf %d %s %s rejected %u in last %ds",
+            rec->conf_id, path, record_name( p, names, rec ), entries[i].n, elapsed);
+    }
+}
+
+/* the parent may not signal its children, EPERM still tells that one runs */
+static int pid_alive( apr_uint32_t pid )
+{
+    return kill( (pid_t)pid, 0 ) == 0 || errno != ESRCH;
+}
+
+#ifdef APACHE24
+static int dirlimit_monitor(apr_pool_t *p, server_rec *s)
+#else
+static int dirlimit_monitor(apr_pool_t *p)
+#endif
+{
+    dirlimit_sconfig *conf;
+    apr_pool_t *tp;
+    apr_time_t now;
+    int n;
+
+#ifndef APACHE24
+    server_rec *s = main_server;
+    if( s == NULL ) {
+        return DECLINED;
+    }
+#endif
+    now = apr_time_now();
+    if( apr_pool_create(&tp, p) != APR_SUCCESS ) {
+        return DECLINED;
+    }
+    do {
+        conf = (dirlimit_sconfig*)(ap_get_module_config(s->module_config, &dirlimit_module));
+        if( conf->eng.shm == NULL ) {
+            continue;
+        }
+        /* counters of children that died before releasing them */
+        n = dirlimit_reap( &conf->eng, pid_alive );
+        if( n > 0 ) {
+            ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, NULL,
+                "mod_dirlimit: reclaimed %d counter(s) held by dead children", n);
+        }
+        /* drop the records kept only for their rate state, a step per tick */
+        if( conf->eng.shm->records_num > 0 &&
+                dirlimit_lock( &conf->eng ) == APR_SUCCESS ) {
+            dirlimit_sweep( &conf->eng, &conf->sweep_pos, SWEEP_STEP );
+            dirlimit_unlock( &conf->eng );
+        }
+        if( conf->log_interval <= 0 ||
+                now - conf->last_report < apr_time_from_sec(conf->log_interval) ) {
+            continue;
+        }
+        report_rejections( tp, conf, (int)apr_time_sec(now - conf->last_report) );
+        conf->last_report = now;
+        apr_pool_clear(tp);
+    } while( (s = s->next) != NULL );
+    apr_pool_destroy(tp);
+    return DECLINED;
+}
+
 static void init_child(apr_pool_t *p, server_rec *s)
 {
     dirlimit_sconfig *conf;
+
+    apr_pool_create( &chain_pool, p );
+#if APR_HAS_THREADS
+    apr_thread_mutex_create( &chain_mutex, APR_THREAD_MUTEX_DEFAULT, p );
+#endif
     do{
         conf = (dirlimit_sconfig*)(ap_get_module_config(s->module_config, &dirlimit_module));
+        if( conf->eng.shm ) {
+            dirlimit_engine_child_init( &conf->eng, p );
+        }
         if(!conf->shm_data){
-            if(apr_global_mutex_child_init(&conf->mutex, MUTEX_PATH, p)) {
+            if(apr_global_mutex_child_init(&conf->eng.mutex, MUTEX_PATH, p)) {
                 DEBUGLOG("global mutex attached!");
             }
             if(apr_shm_attach(&(conf->shm_data), MUTEX_PATH, p) != APR_SUCCESS) {
@@ -859,11 +2986,22 @@ static void init_child(apr_pool_t *p, server_rec *s)
 
 static void dirlimit_register_hooks(apr_pool_t *p)
 {
+    ap_hook_pre_config(pre_config, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_post_config(post_config, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_child_init(init_child, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_fixups(dirlimit_check_limit, NULL, NULL, APR_HOOK_LAST);
     ap_hook_handler(dirlimit_statushandler, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_handler(dirlimit_metricshandler, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_handler(dirlimit_adminhandler, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_log_transaction(dirlimit_response_end, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_monitor(dirlimit_monitor, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_register_output_filter(RELEASE_HANDLER_FILTER, dirlimit_release_handler_filter,
+        NULL, AP_FTYPE_RESOURCE);
+    ap_register_output_filter(RELEASE_EOS_FILTER, dirlimit_release_eos_filter,
+        NULL, AP_FTYPE_PROTOCOL);
+    /* protocol level survives internal redirects */
+    ap_register_output_filter(BANDWIDTH_FILTER, dirlimit_bandwidth_filter,
+        NULL, AP_FTYPE_PROTOCOL);
 }
 
 static const command_rec dirlimit_cmds[] = {
@@ -875,12 +3013,44 @@ static const command_rec dirlimit_cmds[] = {
         "DirLimitPerSub <num>"),
     AP_INIT_TAKE1("DirLimitScriptPerSub", set_limit_script_sub, NULL, ACCESS_CONF,
         "DirLimitScriptPerSub <num>"),
+    AP_INIT_TAKE1("DirLimitPerClient", set_limit_client, NULL, ACCESS_CONF,
+        "DirLimitPerClient <num>"),
+    AP_INIT_TAKE1("DirLimitScriptPerClient", set_limit_script_client, NULL, ACCESS_CONF,
+        "DirLimitScriptPerClient <num>"),
+    AP_INIT_TAKE12("DirLimitLease", set_lease, NULL, ACCESS_CONF,
+        "DirLimitLease <batch> [min_limit]"),
+    AP_INIT_TAKE2("DirLimitAdaptive", set_adaptive, NULL, ACCESS_CONF,
+        "DirLimitAdaptive <min> <max>"),
+    AP_INIT_TAKE2("DirLimitReserve", set_reserve, NULL, ACCESS_CONF,
+        "DirLimitReserve method=...|env=...|net=... <num>"),
+    AP_INIT_TAKE12("DirLimitBandwidth", set_bandwidth, NULL, ACCESS_CONF,
+        "DirLimitBandwidth <bytes/s> [burst]"),
+    AP_INIT_TAKE12("DirLimitBandwidthScript", set_bandwidth_script, NULL, ACCESS_CONF,
+        "DirLimitBandwidthScript <bytes/s> [burst]"),
+    AP_INIT_TAKE12("DirLimitBandwidthPerSub", set_bandwidth_sub, NULL, ACCESS_CONF,
+        "DirLimitBandwidthPerSub <bytes/s> [burst]"),
+    AP_INIT_TAKE12("DirLimitBandwidthScriptPerSub", set_bandwidth_script_sub, NULL, ACCESS_CONF,
+        "DirLimitBandwidthScriptPerSub <bytes/s> [burst]"),
+    AP_INIT_TAKE12("DirLimitRate", set_rate, NULL, ACCESS_CONF,
+        "DirLimitRate <req/s> [burst]"),
+    AP_INIT_TAKE12("DirLimitRatePerSub", set_rate_sub, NULL, ACCESS_CONF,
+        "DirLimitRatePerSub <req/s> [burst]"),
+    AP_INIT_TAKE12("DirLimitWait", set_wait, NULL, ACCESS_CONF,
+        "DirLimitWait <ms> [max_queue]"),
+    AP_INIT_TAKE1("DirLimitRelease", set_release, NULL, RSRC_CONF | ACCESS_CONF,
+        "DirLimitRelease handler|eos|log"),
     AP_INIT_ITERATE("DirLimitSetScriptType", set_script_type, NULL, RSRC_CONF | OR_LIMIT,
         "DirLimitSetScriptType mime-type1 [mime-type2] ..."),
     AP_INIT_ITERATE("DirLimitSetNoScriptType", set_noscript_type, NULL, RSRC_CONF | OR_LIMIT,
         "DirLimitSetNoScriptType mime-type1 [mime-type2] ..."),
     AP_INIT_TAKE1("DirLimitTableSize", set_table_size, NULL, RSRC_CONF,
         "DirLimitTableSize <size>"),
+    AP_INIT_TAKE1("DirLimitClientTableSize", set_client_table_size, NULL, RSRC_CONF,
+        "DirLimitClientTableSize <size>"),
+    AP_INIT_TAKE1("DirLimitShmFile", set_shm_file, NULL, RSRC_CONF,
+        "DirLimitShmFile <path>"),
+    AP_INIT_TAKE1("DirLimitLogInterval", set_log_interval, NULL, RSRC_CONF,
+        "DirLimitLogInterval <sec>"),
    {NULL}
 };
 
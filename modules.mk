@@ -1,4 +1,4 @@
-mod_dirlimit.la: mod_dirlimit.slo
-	$(SH_LINK) -rpath $(libexecdir) -module -avoid-version  mod_dirlimit.lo
+mod_dirlimit.la: mod_dirlimit.slo dirlimit_engine.slo
+	$(SH_LINK) -rpath $(libexecdir) -module -avoid-version  mod_dirlimit.lo dirlimit_engine.lo
 DISTCLEAN_TARGETS = modules.mk
 shared =  mod_dirlimit.la